@@ -118,6 +118,7 @@ class Block {
   int originalLine = -1;
   int originalLineLength = -1;
   // String? originalText;
+  String? syncedText; // as last sent natively with setBlock
   Iterable<RegExpMatch> words = [];
 
   List<LineDecoration>? decors = [];
@@ -180,6 +180,7 @@ class Document {
     for (int i = 0; i < blocks.length; i++) {
       blocks[i].makeDirty(highlight: true, notify: false);
       FFIBridge.setBlock(documentId, blocks[i].blockId, i, blocks[i].text);
+      blocks[i].syncedText = blocks[i].text;
     }
 
     // FFIBridge.runTreeSitter(documentId, docPath);
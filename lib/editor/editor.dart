@@ -59,6 +59,7 @@ class _Editor extends State<Editor> with WidgetsBindingObserver {
 
   List<Block> indexingQueue = [];
   HLLanguage? lang;
+  int languageListener = 0;
 
   @override
   void initState() {
@@ -89,6 +90,15 @@ class _Editor extends State<Editor> with WidgetsBindingObserver {
     d.lineComment = lang?.lineComment ?? '';
     d.blockComment = lang?.blockComment ?? [];
 
+    // highlight again once the grammars it includes are loaded
+    d.languageReady = FFIBridge.language_ready(d.langId) != 0;
+    languageListener = FFIMessaging.instance()
+        .addListener(FFIListener('editor', 'language', (m, l) {
+      if (d.languageReady || m['message']?['ready'] != d.langId) return;
+      d.languageReady = true;
+      d.makeDirty(highlight: true, notify: true);
+    }));
+
     d.addListener('onCreate', (documentId) {
       FFIBridge.run(
           () => FFIBridge.createDocument(documentId, doc.doc.docPath));
@@ -124,6 +134,11 @@ class _Editor extends State<Editor> with WidgetsBindingObserver {
       print(documentId);
     });
     d.addListener('onReady', () {
+      FFIBridge.run(
+          () => FFIBridge.prehighlightDocument(d.documentId, d.langId));
+      // no line is highlighted yet, the scheduler takes those near the view
+      FFIBridge.run(() => FFIBridge.addDirtyLines(
+          d.documentId, List.generate(d.blocks.length, (i) => i)));
       Future.delayed(const Duration(seconds: 3), () {
         indexer.indexFile(widget.path);
       });
@@ -175,6 +190,7 @@ class _Editor extends State<Editor> with WidgetsBindingObserver {
   void dispose() {
     pulse.cancel();
     indexer.dispose();
+    FFIMessaging.instance().removeListener(languageListener);
 
     focusNode.dispose();
     textFocusNode.dispose();
@@ -1,3 +1,4 @@
+import 'dart:async';
 import 'dart:math';
 import 'package:flutter/material.dart';
 import 'package:flutter/rendering.dart';
@@ -13,7 +14,6 @@ import 'package:editor/services/util.dart';
 import 'package:editor/services/timer.dart';
 import 'package:editor/services/input.dart';
 import 'package:editor/services/ui/ui.dart';
-import 'package:editor/services/ffi/bridge.dart';
 import 'package:editor/services/highlight/theme.dart';
 import 'package:editor/services/highlight/highlighter.dart';
 
@@ -402,6 +402,7 @@ class _View extends State<View> {
   late ScrollController scroller;
   late ScrollController hscroller;
   late PeriodicTimer scrollTo;
+  late Timer receiveHighlights;
 
   int visibleStart = -1;
   int visibleEnd = -1;
@@ -420,6 +421,16 @@ class _View extends State<View> {
     hscroller = ScrollController();
     scrollTo = PeriodicTimer();
 
+    // lines near the viewport highlighted in the background
+    receiveHighlights =
+        Timer.periodic(const Duration(milliseconds: 100), (timer) {
+      if (!mounted) return;
+      DocumentProvider doc =
+          Provider.of<DocumentProvider>(context, listen: false);
+      Highlighter hl = Provider.of<Highlighter>(context, listen: false);
+      hl.receive(doc.doc);
+    });
+
     scroller.addListener(() {
       DocumentProvider doc =
           Provider.of<DocumentProvider>(context, listen: false);
@@ -474,6 +485,7 @@ class _View extends State<View> {
     scroller.dispose();
     hscroller.dispose();
     scrollTo.cancel();
+    receiveHighlights.cancel();
     super.dispose();
   }
 
@@ -517,6 +529,12 @@ class _View extends State<View> {
 
     DocumentProvider doc =
         Provider.of<DocumentProvider>(context, listen: false);
+    if (doc.visibleStart != visibleStart || doc.visibleEnd != visibleEnd) {
+      if (visibleStart != -1 && visibleEnd != -1) {
+        Highlighter hl = Provider.of<Highlighter>(context, listen: false);
+        hl.setViewport(doc.doc, visibleStart, visibleEnd - visibleStart + 1);
+      }
+    }
     doc.visibleStart = visibleStart;
     doc.visibleEnd = visibleEnd;
     // print('$visibleStart $visibleEnd');
@@ -638,14 +656,6 @@ class _View extends State<View> {
 
     if (!doc.ready) return Container();
 
-    // todo move to tmparser
-    if (!doc.doc.languageReady) {
-      doc.doc.languageReady = FFIBridge.has_running_threads() == 0;
-      Future.delayed(const Duration(milliseconds: 100), () {
-        doc.doc.makeDirty(highlight: true, notify: true);
-      });
-    }
-
     final TextStyle style = TextStyle(
         fontFamily: theme.fontFamily,
         fontSize: theme.fontSize,
@@ -738,6 +748,18 @@ class _View extends State<View> {
 
     // print('count: $count top: $top visible: $visibleLine');
 
+    // highlight the lines about to be built at once
+    int firstLine = visibleLine - 8;
+    int lastLine = visibleLine + count + 8;
+    if (firstLine < 0) firstLine = 0;
+    if (lastLine > docSize) lastLine = docSize;
+    if (firstLine < lastLine) {
+      firstLine = doc.doc.computedLine(firstLine);
+      lastLine = doc.doc.computedLine(lastLine - 1);
+      Highlighter hl = Provider.of<Highlighter>(context, listen: false);
+      hl.runRange(doc.doc, firstLine, lastLine - firstLine + 1);
+    }
+
     List<Widget> gutters = [];
     List<Widget> children = [];
     for (int i = -8; i < count + 8; i++) {
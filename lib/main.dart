@@ -42,6 +42,7 @@ void main(List<String> args) async {
   }
 
   FFIBridge.initialize(app.extensionsPath);
+  FFIBridge.setGrammarCache(expandPath('$appResourceRoot/cache'));
 
   // FFIMessaging.instance().sendMessage({
   //    'channel': 'git',
@@ -13,6 +13,18 @@ class FFIBridge {
   static late Function load_theme;
   static late Function load_language;
   static late Function run_highlighter;
+  static late Function run_highlighter_range;
+  static late Function invalidate_lines;
+  static late Function run_highlighter_slice;
+  static late Function is_line_pending;
+  static late Function set_long_line_budget;
+  static late Function set_grammar_cache;
+  static late Function prehighlight;
+  static late Function prehighlight_lines;
+  static late Function set_viewport;
+  static late Function add_dirty_lines;
+  static late Function poll_highlights;
+  static late Function receive_highlight;
   static late Function create_document;
   static late Function destroy_document;
   static late Function add_block;
@@ -24,6 +36,7 @@ class FFIBridge {
   static late Function load_icons;
   static late Function icon_for_filename;
   static late Function has_running_threads;
+  static late Function language_ready;
   static late Function send_message;
   static late Function receive_message;
   static late Function poll_messages;
@@ -74,6 +87,75 @@ class FFIBridge {
         Pointer<TextSpanStyle> Function(
             Pointer<Utf8>, int, int, int, int, int, int, int)>();
 
+    final _run_highlighter_range = nativeEditorApiLib.lookup<
+        NativeFunction<
+            Pointer<TextSpanStyle> Function(Int32, Int32, Int32, Int32, Int32,
+                Pointer<Int32>)>>('run_highlighter_range');
+    run_highlighter_range = _run_highlighter_range.asFunction<
+        Pointer<TextSpanStyle> Function(
+            int, int, int, int, int, Pointer<Int32>)>();
+
+    final _invalidate_lines = nativeEditorApiLib.lookup<
+            NativeFunction<Int32 Function(Int32, Int32, Int32, Int32)>>(
+        'invalidate_lines');
+    invalidate_lines =
+        _invalidate_lines.asFunction<int Function(int, int, int, int)>();
+
+    final _run_highlighter_slice = nativeEditorApiLib.lookup<
+        NativeFunction<
+            Pointer<TextSpanStyle> Function(Int32, Int32, Int32, Int32, Int32,
+                Int32)>>('run_highlighter_slice');
+    run_highlighter_slice = _run_highlighter_slice.asFunction<
+        Pointer<TextSpanStyle> Function(int, int, int, int, int, int)>();
+
+    final _is_line_pending = nativeEditorApiLib
+        .lookup<NativeFunction<Int32 Function(Int32, Int32)>>(
+            'is_line_pending');
+    is_line_pending = _is_line_pending.asFunction<int Function(int, int)>();
+
+    final _set_long_line_budget = nativeEditorApiLib
+        .lookup<NativeFunction<Void Function(Int32, Int32)>>(
+            'set_long_line_budget');
+    set_long_line_budget =
+        _set_long_line_budget.asFunction<void Function(int, int)>();
+
+    final _set_grammar_cache = nativeEditorApiLib
+        .lookup<NativeFunction<Void Function(Pointer<Utf8>)>>(
+            'set_grammar_cache');
+    set_grammar_cache =
+        _set_grammar_cache.asFunction<void Function(Pointer<Utf8>)>();
+
+    final _prehighlight = nativeEditorApiLib
+        .lookup<NativeFunction<Void Function(Int32, Int32)>>('prehighlight');
+    prehighlight = _prehighlight.asFunction<void Function(int, int)>();
+
+    final _prehighlight_lines = nativeEditorApiLib
+        .lookup<NativeFunction<Int32 Function(Int32)>>('prehighlight_lines');
+    prehighlight_lines = _prehighlight_lines.asFunction<int Function(int)>();
+
+    final _set_viewport = nativeEditorApiLib.lookup<
+        NativeFunction<
+            Void Function(Int32, Int32, Int32, Int32, Int32)>>('set_viewport');
+    set_viewport = _set_viewport
+        .asFunction<void Function(int, int, int, int, int)>();
+
+    final _add_dirty_lines = nativeEditorApiLib.lookup<
+            NativeFunction<Void Function(Int32, Pointer<Int32>, Int32)>>(
+        'add_dirty_lines');
+    add_dirty_lines = _add_dirty_lines
+        .asFunction<void Function(int, Pointer<Int32>, int)>();
+
+    final _poll_highlights = nativeEditorApiLib
+        .lookup<NativeFunction<Int32 Function(Int32)>>('poll_highlights');
+    poll_highlights = _poll_highlights.asFunction<int Function(int)>();
+
+    final _receive_highlight = nativeEditorApiLib.lookup<
+        NativeFunction<
+            Pointer<TextSpanStyle> Function(
+                Int32, Pointer<Int32>)>>('receive_highlight');
+    receive_highlight = _receive_highlight
+        .asFunction<Pointer<TextSpanStyle> Function(int, Pointer<Int32>)>();
+
     final _create_document = nativeEditorApiLib.lookup<
         NativeFunction<Void Function(Int32, Pointer<Utf8>)>>('create_document');
     create_document =
@@ -106,6 +188,10 @@ class FFIBridge {
         .lookup<NativeFunction<Int32 Function()>>('has_running_threads');
     has_running_threads = _has_running_threads.asFunction<int Function()>();
 
+    final _language_ready = nativeEditorApiLib
+        .lookup<NativeFunction<Int32 Function(Int32)>>('language_ready');
+    language_ready = _language_ready.asFunction<int Function(int)>();
+
     final _send_message = nativeEditorApiLib
         .lookup<NativeFunction<Void Function(Pointer<Utf8>)>>('send_message');
     send_message = _send_message.asFunction<void Function(Pointer<Utf8>)>();
@@ -127,6 +213,13 @@ class FFIBridge {
     calloc.free(_path);
   }
 
+  // grammars are loaded from a binary cache of their rules kept in path
+  static void setGrammarCache(String path) {
+    final _path = path.toNativeUtf8();
+    set_grammar_cache(_path);
+    calloc.free(_path);
+  }
+
   static void createDocument(int id, String path) {
     final _path = path.toNativeUtf8();
     create_document(id, _path);
@@ -196,6 +289,75 @@ class FFIBridge {
     return res;
   }
 
+  // spans of line (first + i) are at [offsets[i], offsets[i + 1])
+  static Pointer<Int32> rangeOffsets = malloc<Int32>(1024 + 1);
+  static Pointer<TextSpanStyle> runHighlighterRange(
+      int lang, int theme, int document, int first, int count) {
+    if (count > 1024) {
+      count = 1024;
+    }
+    return run_highlighter_range(
+        document, lang, theme, first, count, rangeOffsets);
+  }
+
+  // number of lines after line whose starting parser state changed
+  static int invalidateLines(int document, int lang, int line, int limit) {
+    return invalidate_lines(document, lang, line, limit);
+  }
+
+  // spans of bytes [from, to) of a line, long lines are styled in steps
+  static Pointer<TextSpanStyle> runHighlighterSlice(
+      int lang, int theme, int document, int line, int from, int to) {
+    return run_highlighter_slice(document, lang, theme, line, from, to);
+  }
+
+  static bool isLinePending(int document, int line) {
+    return is_line_pending(document, line) != 0;
+  }
+
+  static void setLongLineBudget(int bytes, int milliseconds) {
+    set_long_line_budget(bytes, milliseconds);
+  }
+
+  // parse the whole document in the background, jumps far into it are then
+  // highlighted from the nearest parser state kept on the way
+  static void prehighlightDocument(int document, int lang) {
+    prehighlight(document, lang);
+  }
+
+  // lines before the returned one start in a state known natively
+  static int prehighlightedLines(int document) {
+    return prehighlight_lines(document);
+  }
+
+  // dirty lines are highlighted natively, visible ones first, then those
+  // near them. results are taken with pollHighlights and receiveHighlight
+  static void setViewport(
+      int document, int lang, int theme, int first, int count) {
+    set_viewport(document, lang, theme, first, count);
+  }
+
+  static void addDirtyLines(int document, List<int> lines) {
+    if (lines.isEmpty) return;
+    final _lines = calloc<Int32>(lines.length);
+    for (int i = 0; i < lines.length; i++) {
+      _lines[i] = lines[i];
+    }
+    add_dirty_lines(document, _lines, lines.length);
+    calloc.free(_lines);
+  }
+
+  static int pollHighlights(int document) {
+    return poll_highlights(document);
+  }
+
+  static Pointer<Int32> receivedLine = malloc<Int32>(1);
+
+  // spans of the next highlighted line, its line is in receivedLine
+  static Pointer<TextSpanStyle> receiveHighlight(int document) {
+    return receive_highlight(document, receivedLine);
+  }
+
   static void setBlock(int document, int block, int line, String text) {
     Pointer<Utf8> _t = text.toNativeUtf8();
     set_block(document, block, line, _t);
@@ -73,9 +73,9 @@ class ThemeInfo extends Struct {
 }
 
 class TextSpanStyle extends Struct {
-  @Int16()
+  @Int32()
   external int start;
-  @Int16()
+  @Int32()
   external int length;
   @Int16()
   external int flags;
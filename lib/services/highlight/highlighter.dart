@@ -16,6 +16,15 @@ import 'package:editor/services/highlight/tmparser.dart';
 abstract class HLEngine {
   List<LineDecoration> run(Block? block, int line, Document document);
 
+  // highlight count lines from first ahead of their widgets, engines without
+  // a batched highlight leave them to run
+  void runRange(Document document, int first, int count) {}
+
+  // lines near the viewport may be highlighted in the background, their
+  // results are taken by receive
+  void setViewport(Document document, int first, int count) {}
+  void receive(Document document) {}
+
   void loadTheme(String path);
   HLLanguage loadLanguage(String filename);
   HLLanguage? language(int id);
@@ -59,6 +68,18 @@ class Highlighter {
             : MaterialStateMouseCursor.textable);
   }
 
+  void runRange(Document document, int first, int count) {
+    engine.runRange(document, first, count);
+  }
+
+  void setViewport(Document document, int first, int count) {
+    engine.setViewport(document, first, count);
+  }
+
+  void receive(Document document) {
+    engine.receive(document);
+  }
+
   List<InlineSpan> run(Block? block, int line, Document document,
       {Function? onTap, Function? onHover}) {
     HLTheme theme = HLTheme.instance();
@@ -28,6 +28,19 @@ const int SCOPE_ENTITY = (1 << 13);
 const int SCOPE_ENTITY_CLASS = (1 << 14);
 const int SCOPE_ENTITY_FUNCTION = (1 << 15);
 
+// lines re-parsed at most after an edit, the rest follow as they are shown
+const int INVALIDATE_LIMIT = 1000;
+
+// natively, lines of more bytes than this are parsed over several calls
+const int LONG_LINE_THRESHOLD = 500;
+
+// the threshold is in bytes of utf8, a utf16 unit takes one to three
+bool isLongLine(String text) {
+  if (text.length > LONG_LINE_THRESHOLD) return true;
+  if (text.length * 3 <= LONG_LINE_THRESHOLD) return false;
+  return utf8.encode(text).length > LONG_LINE_THRESHOLD;
+}
+
 class TMParserLanguage extends HLLanguage {}
 
 class TMParser extends HLEngine {
@@ -65,19 +78,43 @@ class TMParser extends HLEngine {
     FFIBridge.loadIcons(path);
   }
 
-  List<LineDecoration> run(Block? block, int line, Document document) {
-    List<LineDecoration> decors = [];
+  // re-parse from an edited block natively, the blocks after it that now
+  // start in a different parser state are highlighted again
+  void invalidate(Block b, Document document) {
+    int documentId = b.document?.documentId ?? 0;
+    FFIBridge.setBlock(documentId, b.blockId, b.line, b.text);
+    int count = FFIBridge.invalidateLines(
+        documentId, document.langId, b.line, INVALIDATE_LIMIT);
+
+    List<int> lines = [];
+    Block? next = b.next;
+    for (int i = 0; i < count && next != null; i++) {
+      // blocks not highlighted yet have nothing to redo
+      if (next.decors != null) {
+        next.makeDirty(highlight: true);
+        lines.add(next.line);
+      }
+      next = next.next;
+    }
+    FFIBridge.addDirtyLines(documentId, lines);
+  }
 
+  // blocks are invalidated only when edited since their text was last sent
+  void sync(Block b, Document document) {
+    if (b.syncedText == b.text) return;
+    b.syncedText = b.text;
+    invalidate(b, document);
+  }
+
+  List<LineDecoration> run(Block? block, int line, Document document) {
     Block b = block ?? Block('', document: Document());
     Block? prevBlock = b.previous;
     Block? nextBlock = b.next;
 
-    b.prevBlockClass = prevBlock?.className ?? '';
-    b.scopes = {};
+    sync(b, document);
 
-    String text = b.text;
     final nspans = FFIBridge.runHighlighter(
-        text,
+        b.text,
         document.langId,
         themeId,
         b.document?.documentId ?? 0,
@@ -86,13 +123,78 @@ class TMParser extends HLEngine {
         prevBlock?.blockId ?? 0,
         nextBlock?.blockId ?? 0);
 
-    text += ' ';
+    List<LineDecoration> decors = decorate(b, nspans, 0);
+
+    // long lines are parsed over several frames
+    if (FFIBridge.isLinePending(b.document?.documentId ?? 0, b.line)) {
+      Future.delayed(const Duration(milliseconds: 0), () {
+        b.makeDirty(highlight: true);
+      });
+    }
+
+    return decors;
+  }
+
+  // blocks not highlighted yet among count lines from first are highlighted
+  // in a single native call. long lines are left to run
+  void runRange(Document document, int first, int count) {
+    if (count > 1024) {
+      count = 1024;
+    }
+
+    bool dirty = false;
+    for (int i = 0; i < count; i++) {
+      Block? b = document.blockAtLine(first + i);
+      if (b == null) {
+        count = i;
+        break;
+      }
+      if (b.decors == null && !isLongLine(b.text)) {
+        sync(b, document);
+        dirty = true;
+      }
+    }
+    if (!dirty) return;
+
+    final nspans = FFIBridge.runHighlighterRange(
+        document.langId, themeId, document.documentId, first, count);
+    for (int i = 0; i < count; i++) {
+      Block? b = document.blockAtLine(first + i);
+      if (b == null || b.decors != null || isLongLine(b.text)) continue;
+      decorate(b, nspans, FFIBridge.rangeOffsets[i],
+          end: FFIBridge.rangeOffsets[i + 1]);
+    }
+  }
 
-    bool comment = false;
-    bool string = false;
+  void setViewport(Document document, int first, int count) {
+    FFIBridge.setViewport(
+        document.documentId, document.langId, themeId, first, count);
+  }
 
-    int idx = 0;
-    while (idx < (2048 * 4)) {
+  // blocks highlighted by the native scheduler are decorated unless they
+  // have been highlighted or edited since
+  void receive(Document document) {
+    int count = FFIBridge.pollHighlights(document.documentId);
+    for (int i = 0; i < count; i++) {
+      final nspans = FFIBridge.receiveHighlight(document.documentId);
+      int line = FFIBridge.receivedLine[0];
+      if (line < 0) break;
+      Block? b = document.blockAtLine(line);
+      if (b == null || b.decors != null || isLongLine(b.text)) continue;
+      if (b.syncedText != b.text) continue;
+      decorate(b, nspans, 0);
+    }
+  }
+
+  // decorations of a block from the spans at idx of a native buffer, up to
+  // its end marker
+  List<LineDecoration> decorate(Block b, Pointer<TextSpanStyle> nspans, int idx,
+      {int end = 2048 * 4}) {
+    List<LineDecoration> decors = [];
+    b.scopes = {};
+
+    String text = b.text + ' ';
+    while (idx < end) {
       final spn = nspans[idx++];
       if (spn.start == 0 && spn.length == 0) break;
       int s = spn.start;
@@ -120,9 +222,6 @@ class TMParser extends HLEngine {
 
       decors.add(d);
 
-      comment = (spn.flags & SCOPE_COMMENT_BLOCK) == SCOPE_COMMENT_BLOCK;
-      string = (spn.flags & SCOPE_STRING) == SCOPE_STRING;
-
       if (spn.flags != 0) {
         b.scopes[s] = spn.flags;
         b.scopes[s + l + 1] = 0;
@@ -132,14 +231,6 @@ class TMParser extends HLEngine {
     }
 
     b.decors = decors;
-    b.className = comment ? 'comment' : (string ? 'string' : '');
-
-    if (nextBlock != null) {
-      if (nextBlock.prevBlockClass != b.className) {
-        nextBlock.makeDirty(highlight: true);
-      }
-    }
-
     return decors;
   }
 
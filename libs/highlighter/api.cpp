@@ -1,5 +1,10 @@
 #include "api.h"
 
+#include <climits>
+
+// documents may be looked up from highlighting threads, blocks of a
+// document are guarded by Document::mutex
+static std::mutex documents_mutex;
 std::map<size_t, DocumentPtr> documents;
 
 void delay(int ms) {
@@ -10,10 +15,98 @@ void delay(int ms) {
   nanosleep(&waittime, NULL);
 }
 
-DocumentPtr get_document(int id) { return documents[id]; }
+DocumentPtr get_document(int id) {
+  std::lock_guard<std::mutex> lock(documents_mutex);
+  auto it = documents.find(id);
+  if (it == documents.end()) {
+    return NULL;
+  }
+  return it->second;
+}
+
+BlockPtr Document::block_at_line(int line) {
+  if (line < 0 || (size_t)line >= lines.size()) {
+    return NULL;
+  }
+  return lines[line];
+}
+
+// where a line is after another was changed, -1 if it was removed
+static int moved_line(int line, int changed, int shift) {
+  if (shift < 0 && line == changed) {
+    return -1;
+  }
+  return line > changed || (line == changed && shift > 0) ? line + shift
+                                                           : line;
+}
+
+void Document::line_changed(int line, int shift) {
+  // results before the change stay valid
+  for (auto it = highlighted.begin(); it != highlighted.end();) {
+    if (it->line == line || (shift != 0 && it->line > line)) {
+      it = highlighted.erase(it);
+      continue;
+    }
+    it++;
+  }
+
+  if (shift != 0) {
+    std::set<int> moved;
+    for (int d : dirty) {
+      int m = moved_line(d, line, shift);
+      if (m >= 0) {
+        moved.insert(m);
+      }
+    }
+    dirty.swap(moved);
+    for (int &s : scheduled) {
+      s = moved_line(s, line, shift);
+    }
+  }
+
+  if (prehighlight_lang < 0) {
+    return;
+  }
+
+  if (shift != 0) {
+    std::set<int> moved;
+    for (int e : edited) {
+      moved.insert(e > line || (e == line && shift > 0) ? e + shift : e);
+    }
+    edited.swap(moved);
+
+    // the state after a removed line is gone, the one before it stays
+    for (auto it = checkpoints.begin(); it != checkpoints.end();) {
+      if (shift < 0 && it->line == line + 1) {
+        it = checkpoints.erase(it);
+        continue;
+      }
+      if (it->line > line) {
+        it->line += shift;
+      }
+      it++;
+    }
+  }
+
+  edited.insert(line);
+  prehighlight_generation++;
+}
+
+Document::checkpoint_t Document::checkpoint_before(int line) {
+  checkpoint_t res = {0, NULL};
+  int verified = edited.empty() ? INT_MAX : *edited.begin();
+  for (auto const &checkpoint : checkpoints) {
+    if (checkpoint.line >= line || checkpoint.line > verified) {
+      break;
+    }
+    res = checkpoint;
+  }
+  return res;
+}
 
 EXPORT
 void create_document(int documentId, char *path) {
+  std::lock_guard<std::mutex> lock(documents_mutex);
   if (documents[documentId] == NULL) {
     documents[documentId] = std::make_shared<Document>();
     if (path != NULL) {
@@ -23,43 +116,101 @@ void create_document(int documentId, char *path) {
 }
 
 EXPORT
-void destroy_document(int documentId) { documents[documentId] = NULL; }
+void destroy_document(int documentId) {
+  std::lock_guard<std::mutex> lock(documents_mutex);
+  DocumentPtr doc = documents[documentId];
+  if (doc) {
+    // stops its background thread
+    std::lock_guard<std::mutex> doc_lock(doc->mutex);
+    doc->prehighlight_lang = -1;
+    doc->scheduled.clear();
+  }
+  documents[documentId] = NULL;
+}
 
 EXPORT
 void add_block(int documentId, int blockId, int line) {
-  if (documents[documentId] == NULL) {
+  DocumentPtr doc = get_document(documentId);
+  if (doc == NULL) {
     return;
   }
-  if (documents[documentId]->blocks[blockId] == NULL) {
-    documents[documentId]->blocks[blockId] = std::make_shared<Block>();
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  if (doc->blocks[blockId] == NULL) {
+    doc->blocks[blockId] = std::make_shared<Block>();
+  }
+
+  std::vector<BlockPtr> &lines = doc->lines;
+  if (line >= 0 && (size_t)line <= lines.size()) {
+    lines.insert(lines.begin() + line, doc->blocks[blockId]);
+    doc->line_changed(line, 1);
+    resume_worker(doc);
   }
 }
 
 EXPORT
 void remove_block(int documentId, int blockId, int line) {
-  if (documents[documentId] == NULL) {
+  DocumentPtr doc = get_document(documentId);
+  if (doc == NULL) {
     return;
   }
-  documents[documentId]->blocks[blockId] = NULL;
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  BlockPtr block = doc->blocks[blockId];
+  std::vector<BlockPtr> &lines = doc->lines;
+  if (line >= 0 && (size_t)line < lines.size() && lines[line] == block) {
+    lines.erase(lines.begin() + line);
+    doc->line_changed(line, -1);
+  } else {
+    auto it = std::find(lines.begin(), lines.end(), block);
+    if (it != lines.end()) {
+      doc->line_changed(it - lines.begin(), -1);
+      lines.erase(it);
+    }
+  }
+  resume_worker(doc);
+
+  doc->blocks[blockId] = NULL;
 }
 
 EXPORT
 void set_block(int documentId, int blockId, int line, char *text) {
-  if (documents[documentId] == NULL) {
+  DocumentPtr doc = get_document(documentId);
+  if (doc == NULL) {
     create_document(documentId, NULL);
+    doc = get_document(documentId);
   }
-  if (documents[documentId]->blocks[blockId] == NULL) {
-    documents[documentId]->blocks[blockId] = std::make_shared<Block>();
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  if (doc->blocks[blockId] == NULL) {
+    doc->blocks[blockId] = std::make_shared<Block>();
   }
 
-  if (documents[documentId]->blocks[blockId]->text != text) {
+  bool changed = false;
+  if (doc->blocks[blockId]->text != text) {
     // printf(">>[%s]\n[%s]\n",
-    // documents[documentId]->blocks[blockId]->text.c_str(), text);
-    documents[documentId]->blocks[blockId]->text = text;
-    documents[documentId]->rebuild = true;
+    // doc->blocks[blockId]->text.c_str(), text);
+    doc->blocks[blockId]->text = text;
+    doc->rebuild = true;
+    changed = true;
   }
   if (line == 0) {
-    documents[documentId]->start = documents[documentId]->blocks[blockId];
+    doc->start = doc->blocks[blockId];
+  }
+
+  std::vector<BlockPtr> &lines = doc->lines;
+  if (line >= 0) {
+    if ((size_t)line >= lines.size()) {
+      lines.resize(line + 1);
+    }
+    if (lines[line] != doc->blocks[blockId]) {
+      lines[line] = doc->blocks[blockId];
+      changed = true;
+    }
+    if (changed) {
+      doc->line_changed(line, 0);
+      resume_worker(doc);
+    }
   }
 }
 
@@ -14,10 +14,13 @@ extern "C" {
 
 #include "textmate.h"
 #include <algorithm>
+#include <deque>
 #include <functional>
 #include <json/json.h>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <time.h>
 #include <vector>
@@ -56,15 +59,58 @@ public:
   std::string path;
   std::string contents;
   std::map<size_t, BlockPtr> blocks;
+  std::vector<BlockPtr> lines;
   TSTree *tree;
 
   BlockPtr start;
+
+  // held while blocks or lines are read or changed
+  std::mutex mutex;
+
+  BlockPtr block_at_line(int line);
+
+  // parser states at the start of lines, kept by the background
+  // pre-highlight about every PREHIGHLIGHT_STEP lines. edited holds lines
+  // changed since, checkpoints after the first of them are not verified yet
+  struct checkpoint_t {
+    int line;
+    parse::stack_ptr state;
+  };
+  std::vector<checkpoint_t> checkpoints;
+  std::set<int> edited;
+  int prehighlight_lang; // -1 if not pre-highlighted
+  int prehighlight_generation;
+
+  // dirty lines are highlighted in the order scheduled by the viewport,
+  // results wait in highlighted until received
+  struct highlighted_t {
+    int line;
+    std::vector<textstyle_t> textstyles;
+  };
+  std::set<int> dirty;
+  std::vector<int> scheduled;
+  size_t scheduled_next;
+  int schedule_lang;
+  int schedule_theme;
+  std::deque<highlighted_t> highlighted;
+
+  // set while the background thread of the document runs
+  bool working;
+
+  // a line's text changed (shift 0), or it was inserted (1) or removed (-1)
+  void line_changed(int line, int shift);
+  // the last verified checkpoint before line, or line 0 in no state
+  checkpoint_t checkpoint_before(int line);
 };
 
 typedef std::shared_ptr<Document> DocumentPtr;
 
 DocumentPtr get_document(int id);
 
+// start the background thread of a document if it has lines to highlight
+// or parse. doc->mutex is held
+void resume_worker(DocumentPtr doc);
+
 struct message_t {
   int messageId;
   std::string receiver;
@@ -5,7 +5,9 @@
 #include "theme.h"
 
 #include <fstream>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <pthread.h>
 #include <string>
 #include <time.h>
@@ -13,16 +15,25 @@
 #include "api.h"
 
 #define SKIP_PARSE_THRESHOLD 500
-#define MAX_STYLED_SPANS 512
-#define MAX_BUFFER_LENGTH (1024 * 4)
+#define PREHIGHLIGHT_STEP 256
+#define PREHIGHLIGHT_CATCH_UP (PREHIGHLIGHT_STEP * 2)
+#define SCHEDULE_BATCH 8
 
-static textstyle_t textstyle_buffer[MAX_STYLED_SPANS];
-static char text_buffer[MAX_BUFFER_LENGTH];
+// returned buffers are per thread, valid until the next call on that thread
+static thread_local std::vector<textstyle_t> textstyle_buffer;
 
 EXPORT
 void set_block(int documentId, int blockId, int line, char *text);
 
-Document::Document() : documentId(0), tree(0), rebuild(false) {}
+static std::vector<textstyle_t> highlight_block(Document *doc,
+                                                language_info_ptr lang,
+                                                int langId, theme_ptr theme,
+                                                int line);
+
+Document::Document()
+    : documentId(0), tree(0), rebuild(false), prehighlight_lang(-1),
+      prehighlight_generation(0), scheduled_next(0), schedule_lang(-1),
+      schedule_theme(0), working(false) {}
 
 Document::~Document() {
 #ifdef ENABLE_TREESITTER
@@ -37,8 +48,34 @@ void git_init();
 void ssh_init();
 void treesitter_init();
 
+// languages whose grammars became ready on a loading thread, posted as
+// messages on the language channel when messages are polled
+static std::mutex ready_languages_mutex;
+static std::vector<int> ready_languages;
+
+static void language_poll_callback(listener_t l) {
+  std::vector<int> ready;
+  {
+    std::lock_guard<std::mutex> lock(ready_languages_mutex);
+    ready.swap(ready_languages);
+  }
+  for (int id : ready) {
+    Json::Value json;
+    json["channel"] = "language";
+    json["message"]["ready"] = id;
+    message_t m = {.messageId = 0,
+                   .receiver = "",
+                   .sender = "",
+                   .channel = "language",
+                   .message = json,
+                   .dispatched = false};
+    post_message(m);
+  }
+}
+
 EXPORT void initialize(char *extensionsPath) {
   Textmate::initialize(extensionsPath);
+  add_listener("language_global", "language", nullptr, &language_poll_callback);
 #ifdef ENABLE_GIT
   git_init();
 #endif
@@ -60,48 +97,597 @@ EXPORT int load_theme(char *path) { return Textmate::load_theme(path); }
 
 EXPORT int load_icons(char *path) { return Textmate::load_icons(path); }
 
-EXPORT int load_language(char *path) { return Textmate::load_language(path); }
+// a message on the language channel tells when the language is ready
+EXPORT int load_language(char *path) {
+  int id = Textmate::load_language(path);
+  language_info_ptr lang = Textmate::language_info(id);
+  if (lang && lang->grammar) {
+    lang->grammar->on_ready([id]() {
+      std::lock_guard<std::mutex> lock(ready_languages_mutex);
+      ready_languages.push_back(id);
+    });
+  }
+  return id;
+}
+
+// included grammars are loaded and the language highlights fully
+EXPORT int language_ready(int langId) {
+  return Textmate::is_language_ready(langId);
+}
+
+static bool has_scheduled(Document *doc) {
+  return doc->schedule_lang >= 0 &&
+         doc->scheduled_next < doc->scheduled.size();
+}
+
+// a scheduled line far after the pre-highlight would start in a wrong
+// state, it waits for the pre-highlight to come closer
+static bool scheduled_reachable(Document *doc) {
+  if (doc->prehighlight_lang < 0 || doc->edited.empty()) {
+    return true;
+  }
+  int line = doc->scheduled[doc->scheduled_next];
+  BlockPtr previous_block = doc->block_at_line(line - 1);
+  return !previous_block || previous_block->parser_state ||
+         line - doc->checkpoint_before(line).line <= PREHIGHLIGHT_CATCH_UP;
+}
+
+// highlight the next few scheduled lines that are dirty. a long line not
+// done in one call stays next. doc->mutex is held
+static void highlight_scheduled(Document *doc) {
+  language_info_ptr lang = Textmate::language_info(doc->schedule_lang);
+  theme_ptr theme = Textmate::theme(doc->schedule_theme);
+  for (int i = 0; i < SCHEDULE_BATCH && has_scheduled(doc); i++) {
+    int line = doc->scheduled[doc->scheduled_next];
+    if (!doc->dirty.count(line)) {
+      doc->scheduled_next++;
+      continue;
+    }
+
+    Document::highlighted_t res;
+    res.line = line;
+    res.textstyles =
+        highlight_block(doc, lang, doc->schedule_lang, theme, line);
+    if (Textmate::is_long_line_pending(doc->block_at_line(line).get())) {
+      return;
+    }
+    doc->scheduled_next++;
+    doc->dirty.erase(line);
+    doc->highlighted.push_back(res);
+  }
+}
+
+// a language the worker parses with whose grammar is still loading its
+// includes. lines parsed before it is ready come out differently
+static language_info_ptr loading_language(Document *doc) {
+  int ids[] = {doc->schedule_lang, doc->prehighlight_lang};
+  for (int id : ids) {
+    if (id >= 0 && !Textmate::is_language_ready(id)) {
+      return Textmate::language_info(id);
+    }
+  }
+  return NULL;
+}
+
+// the background thread of a document highlights the lines scheduled by
+// the viewport first. when there are none, the pre-highlight parses the
+// document from its first edited line (all of it when started) up to
+// PREHIGHLIGHT_STEP lines at a time, without the lock. each step ends at a
+// checkpoint. one found in the state it had before verifies the edits
+// before it, the lines after it need no parse. while a grammar is loading
+// the thread ends, it is started again when the grammar is ready
+static void *document_thread(void *arg) {
+  DocumentPtr doc = *(DocumentPtr *)arg;
+  delete (DocumentPtr *)arg;
+
+  std::vector<std::string> texts;
+  while (true) {
+    std::unique_lock<std::mutex> lock(doc->mutex);
+    language_info_ptr loading = loading_language(doc.get());
+    if (loading) {
+      doc->working = false;
+      lock.unlock();
+      std::weak_ptr<Document> weak = doc;
+      loading->grammar->on_ready([weak]() {
+        DocumentPtr doc = weak.lock();
+        if (doc) {
+          std::lock_guard<std::mutex> lock(doc->mutex);
+          resume_worker(doc);
+        }
+      });
+      return NULL;
+    }
+
+    if (has_scheduled(doc.get()) && scheduled_reachable(doc.get())) {
+      highlight_scheduled(doc.get());
+      continue;
+    }
+    if (doc->prehighlight_lang < 0 || doc->edited.empty()) {
+      doc->working = false;
+      return NULL;
+    }
+
+    language_info_ptr lang = Textmate::language_info(doc->prehighlight_lang);
+    Document::checkpoint_t start =
+        doc->checkpoint_before(*doc->edited.begin() + 1);
+    auto next = std::upper_bound(
+        doc->checkpoints.begin(), doc->checkpoints.end(), start.line,
+        [](int line, Document::checkpoint_t const &checkpoint) {
+          return line < checkpoint.line;
+        });
+    int end = start.line + PREHIGHLIGHT_STEP;
+    if (next != doc->checkpoints.end() && next->line < end) {
+      end = next->line;
+    }
+    if (end > (int)doc->lines.size()) {
+      end = doc->lines.size();
+    }
+
+    texts.clear();
+    for (int line = start.line; line < end; line++) {
+      BlockPtr block = doc->lines[line];
+      texts.push_back(block ? block->text : "");
+    }
+    int generation = doc->prehighlight_generation;
+    lock.unlock();
+
+    parse::stack_ptr state = start.state;
+    for (auto const &text : texts) {
+      state = Textmate::parse_line(text, lang, state);
+    }
+
+    lock.lock();
+    if (doc->prehighlight_generation != generation) {
+      continue;
+    }
+
+    if (end >= (int)doc->lines.size()) {
+      doc->edited.clear();
+      while (!doc->checkpoints.empty() &&
+             doc->checkpoints.back().line >= end) {
+        doc->checkpoints.pop_back();
+      }
+      continue;
+    }
+
+    doc->edited.erase(doc->edited.begin(), doc->edited.lower_bound(end));
+    next = std::lower_bound(
+        doc->checkpoints.begin(), doc->checkpoints.end(), end,
+        [](Document::checkpoint_t const &checkpoint, int line) {
+          return checkpoint.line < line;
+        });
+    if (next != doc->checkpoints.end() && next->line == end) {
+      if (parse::equal(next->state, state)) {
+        continue;
+      }
+      next->state = state;
+    } else {
+      Document::checkpoint_t checkpoint = {end, state};
+      doc->checkpoints.insert(next, checkpoint);
+    }
+    // the lines after it start in a different state
+    doc->edited.insert(end);
+  }
+}
+
+void resume_worker(DocumentPtr doc) {
+  if (doc->working) {
+    return;
+  }
+  if (!has_scheduled(doc.get()) &&
+      (doc->prehighlight_lang < 0 || doc->edited.empty())) {
+    return;
+  }
+
+  doc->working = true;
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, NULL, &document_thread,
+                     new DocumentPtr(doc)) != 0) {
+    doc->working = false;
+    return;
+  }
+  pthread_detach(thread_id);
+}
+
+// parse a document in the background, keeping the parser state every
+// PREHIGHLIGHT_STEP lines. lines far from any highlighted line, as after a
+// jump, are then highlighted from the nearest of these
+EXPORT
+void prehighlight(int documentId, int langId) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  if (doc->prehighlight_lang != langId) {
+    doc->prehighlight_lang = langId;
+    doc->checkpoints.clear();
+    doc->edited.clear();
+    doc->edited.insert(0);
+    doc->prehighlight_generation++;
+  }
+  resume_worker(doc);
+}
+
+// lines before the returned one start in a state known to the pre-highlight
+EXPORT
+int prehighlight_lines(int documentId) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  if (doc->prehighlight_lang < 0) {
+    return 0;
+  }
+  return doc->edited.empty() ? doc->lines.size() : *doc->edited.begin() + 1;
+}
+
+// a line after one never parsed, as after a jump, gets the states of the
+// lines before it from the nearest checkpoint. doc->mutex is held
+static void catch_up(Document *doc, language_info_ptr lang, int langId,
+                     int line) {
+  BlockPtr previous_block = doc->block_at_line(line - 1);
+  if (!previous_block || previous_block->parser_state ||
+      doc->prehighlight_lang != langId) {
+    return;
+  }
+
+  Document::checkpoint_t start = doc->checkpoint_before(line);
+  if (line - start.line > PREHIGHLIGHT_CATCH_UP) {
+    return;
+  }
+
+  // from the last line parsed since, if any
+  int from = line - 1;
+  while (from > start.line) {
+    BlockPtr block = doc->block_at_line(from - 1);
+    if (block && block->parser_state) {
+      break;
+    }
+    from--;
+  }
+
+  block_data_t checkpoint_block;
+  checkpoint_block.parser_state = start.state;
+  for (int i = from; i < line; i++) {
+    BlockPtr block = doc->block_at_line(i);
+    if (!block) {
+      return;
+    }
+    BlockPtr prev = doc->block_at_line(i - 1);
+    block_data_t *prev_data = i == start.line ? &checkpoint_block : prev.get();
+    Textmate::run_parser((char *)block->text.c_str(), lang, block.get(),
+                         prev_data);
+  }
+}
 
 EXPORT
 textstyle_t *run_highlighter(char *_text, int langId, int themeId,
                              int documentId, int blockId, int line,
                              int previousBlockId, int nextBlockId) {
-  // end marker
-  textstyle_buffer[0].start = 0;
-  textstyle_buffer[0].length = 0;
   set_block(documentId, blockId, line, _text);
 
-  block_data_t *block = get_document(documentId)->blocks[blockId].get();
-  block_data_t *previous_block =
-      get_document(documentId)->blocks[previousBlockId].get();
-  block_data_t *next_block =
-      get_document(documentId)->blocks[nextBlockId].get();
+  DocumentPtr doc = get_document(documentId);
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  catch_up(doc.get(), Textmate::language_info(langId), langId, line);
+  block_data_t *block = doc->blocks[blockId].get();
+  block_data_t *previous_block = doc->blocks[previousBlockId].get();
+  block_data_t *next_block = doc->blocks[nextBlockId].get();
 
   // printf("line %d\n", line);
 
   std::string tmp = _text;
   std::vector<textstyle_t> res = Textmate::run_highlighter(
-      _text, Textmate::language_info(langId), Textmate::theme(), block,
+      _text, Textmate::language_info(langId), Textmate::theme(themeId), block,
       previous_block, next_block);
 
-  int idx = 0;
-  for (auto r : res) {
-    textstyle_buffer[idx] = r;
-    // memcpy(&textstyle_buffer[idx], &r, sizeof(textstyle_t));
-    // printf(">(%d-%d) %d %d %d\n",
-    //     textstyle_buffer[idx].start,
-    //     textstyle_buffer[idx].length,
-    //     textstyle_buffer[idx].r,
-    //     textstyle_buffer[idx].g,
-    //     textstyle_buffer[idx].b);
-    idx++;
-    if (idx + 1 == MAX_STYLED_SPANS)
+  // spans are not capped, long lines may have many
+  textstyle_buffer.swap(res);
+
+  // end marker
+  textstyle_t end = {0};
+  textstyle_buffer.push_back(end);
+  return &textstyle_buffer[0];
+}
+
+// highlight only the bytes [from, to) of a line, as for the visible part of
+// a long line. the text is taken from set_block
+EXPORT
+textstyle_t *run_highlighter_slice(int documentId, int langId, int themeId,
+                                   int line, int from, int to) {
+  textstyle_buffer.clear();
+
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    textstyle_t end = {0};
+    textstyle_buffer.push_back(end);
+    return &textstyle_buffer[0];
+  }
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  BlockPtr block = doc->block_at_line(line);
+  if (block) {
+    catch_up(doc.get(), Textmate::language_info(langId), langId, line);
+    BlockPtr previous_block = doc->block_at_line(line - 1);
+    BlockPtr next_block = doc->block_at_line(line + 1);
+    textstyle_buffer = Textmate::run_highlighter_slice(
+        (char *)block->text.c_str(), Textmate::language_info(langId),
+        Textmate::theme(themeId), block.get(), previous_block.get(),
+        next_block.get(), from, to);
+  }
+
+  // end marker
+  textstyle_t end = {0};
+  textstyle_buffer.push_back(end);
+  return &textstyle_buffer[0];
+}
+
+// a long line parsed in steps is not done yet, highlight it again
+EXPORT
+int is_line_pending(int documentId, int line) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  return Textmate::is_long_line_pending(doc->block_at_line(line).get());
+}
+
+EXPORT
+void set_long_line_budget(int bytes, int milliseconds) {
+  Textmate::set_long_line_budget(bytes, milliseconds);
+}
+
+// grammars loaded after this read their rules from a binary cache kept
+// in path, written on their first load
+EXPORT
+void set_grammar_cache(char *path) { Textmate::set_grammar_cache(path); }
+
+static thread_local std::vector<textstyle_t> textstyle_range_buffer;
+
+// highlight a line of a locked document, texts are taken from set_block
+static std::vector<textstyle_t> highlight_block(Document *doc,
+                                                language_info_ptr lang,
+                                                int langId, theme_ptr theme,
+                                                int line) {
+  BlockPtr block = doc->block_at_line(line);
+  if (!block) {
+    return std::vector<textstyle_t>();
+  }
+  catch_up(doc, lang, langId, line);
+  BlockPtr previous_block = doc->block_at_line(line - 1);
+  BlockPtr next_block = doc->block_at_line(line + 1);
+  return Textmate::run_highlighter((char *)block->text.c_str(), lang, theme,
+                                   block.get(), previous_block.get(),
+                                   next_block.get());
+}
+
+// highlight count lines starting at firstLine in a single call
+// block texts are taken from set_block, parser state is carried from line to
+// line natively. spans for line (firstLine + i) are at
+// [offsets[i], offsets[i + 1]) of the returned buffer
+EXPORT
+textstyle_t *run_highlighter_range(int documentId, int langId, int themeId,
+                                   int firstLine, int count, int *offsets) {
+  textstyle_range_buffer.clear();
+
+  DocumentPtr doc = get_document(documentId);
+  language_info_ptr lang = Textmate::language_info(langId);
+  theme_ptr theme = Textmate::theme(themeId);
+
+  std::unique_lock<std::mutex> lock;
+  if (doc) {
+    lock = std::unique_lock<std::mutex>(doc->mutex);
+  }
+
+  for (int i = 0; i < count; i++) {
+    offsets[i] = textstyle_range_buffer.size();
+    if (!doc) {
+      continue;
+    }
+
+    std::vector<textstyle_t> res =
+        highlight_block(doc.get(), lang, langId, theme, firstLine + i);
+
+    textstyle_range_buffer.insert(textstyle_range_buffer.end(), res.begin(),
+                                  res.end());
+  }
+  offsets[count] = textstyle_range_buffer.size();
+
+  // end marker
+  textstyle_t end = {0};
+  textstyle_range_buffer.push_back(end);
+  return &textstyle_range_buffer[0];
+}
+
+// reentrant variants, spans are written to out which holds capacity spans
+// the number of spans is returned even if it is more than capacity, so the
+// caller can grow its buffer and ask again. documents may be highlighted
+// from several threads at once, calls on the same document are serialized
+EXPORT
+int highlight_line(int documentId, int langId, int themeId, int line,
+                   textstyle_t *out, int capacity) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return 0;
+  }
+
+  language_info_ptr lang = Textmate::language_info(langId);
+  theme_ptr theme = Textmate::theme(themeId);
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  std::vector<textstyle_t> res = highlight_block(doc.get(), lang, langId, theme, line);
+
+  int spans = res.size();
+  if (spans > 0 && capacity > 0) {
+    memcpy(out, &res[0], sizeof(textstyle_t) * std::min(spans, capacity));
+  }
+  return spans;
+}
+
+// spans for line (firstLine + i) are at [offsets[i], offsets[i + 1]) of out
+EXPORT
+int highlight_range(int documentId, int langId, int themeId, int firstLine,
+                    int count, int *offsets, textstyle_t *out, int capacity) {
+  DocumentPtr doc = get_document(documentId);
+  language_info_ptr lang = Textmate::language_info(langId);
+  theme_ptr theme = Textmate::theme(themeId);
+
+  std::unique_lock<std::mutex> lock;
+  if (doc) {
+    lock = std::unique_lock<std::mutex>(doc->mutex);
+  }
+
+  int spans = 0;
+  for (int i = 0; i < count; i++) {
+    offsets[i] = spans;
+    if (!doc) {
+      continue;
+    }
+
+    std::vector<textstyle_t> res =
+        highlight_block(doc.get(), lang, langId, theme, firstLine + i);
+    for (auto r : res) {
+      if (spans < capacity) {
+        out[spans] = r;
+      }
+      spans++;
+    }
+  }
+  offsets[count] = spans;
+  return spans;
+}
+
+// schedule the dirty lines of a document by the viewport, the visible lines
+// [firstLine, firstLine + count) first, then as many lines below and above
+// them. lines scheduled before and not yet highlighted are dropped, they
+// stay dirty. the rest of the document is pre-highlighted in idle time
+EXPORT
+void set_viewport(int documentId, int langId, int themeId, int firstLine,
+                  int count) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  int lines = doc->lines.size();
+  int below = std::min(firstLine + count * 2, lines);
+  int above = std::max(firstLine - count, 0);
+
+  doc->schedule_lang = langId;
+  doc->schedule_theme = themeId;
+  doc->scheduled.clear();
+  doc->scheduled_next = 0;
+  for (int line = std::max(firstLine, 0); line < below; line++) {
+    doc->scheduled.push_back(line);
+  }
+  for (int line = above; line < firstLine && line < lines; line++) {
+    doc->scheduled.push_back(line);
+  }
+  resume_worker(doc);
+}
+
+// lines to be highlighted again, as when their text or the state they start
+// in has changed. they are highlighted when the viewport reaches them
+EXPORT
+void add_dirty_lines(int documentId, int *lines, int count) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  for (int i = 0; i < count; i++) {
+    doc->dirty.insert(lines[i]);
+  }
+  // scheduled lines already passed may be dirty again
+  doc->scheduled_next = 0;
+  resume_worker(doc);
+}
+
+// the number of lines highlighted by the scheduler and not yet received
+EXPORT
+int poll_highlights(int documentId) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  return doc->highlighted.size();
+}
+
+// the spans of the next line highlighted by the scheduler, its line is
+// written to line, -1 if there is none
+EXPORT
+textstyle_t *receive_highlight(int documentId, int *line) {
+  textstyle_buffer.clear();
+  *line = -1;
+
+  DocumentPtr doc = get_document(documentId);
+  if (doc) {
+    std::lock_guard<std::mutex> lock(doc->mutex);
+    if (!doc->highlighted.empty()) {
+      Document::highlighted_t &res = doc->highlighted.front();
+      *line = res.line;
+      textstyle_buffer.swap(res.textstyles);
+      doc->highlighted.pop_front();
+    }
+  }
+
+  // end marker
+  textstyle_t end = {0};
+  textstyle_buffer.push_back(end);
+  return &textstyle_buffer[0];
+}
+
+// re-parse from an edited line until the parser state converges
+// returns n, lines (line + 1) to (line + n) start in a different state and
+// need to be re-highlighted. stops at the first line whose end state is
+// unchanged, at a line never parsed before, or after limit lines. a line
+// after one never parsed starts in no known state, nothing is invalidated
+EXPORT
+int invalidate_lines(int documentId, int langId, int line, int limit) {
+  DocumentPtr doc = get_document(documentId);
+  if (!doc) {
+    return 0;
+  }
+
+  language_info_ptr lang = Textmate::language_info(langId);
+
+  std::lock_guard<std::mutex> lock(doc->mutex);
+  if (line > 0) {
+    BlockPtr previous_block = doc->block_at_line(line - 1);
+    if (!previous_block || !previous_block->parser_state) {
+      return 0;
+    }
+  }
+
+  int count = 0;
+  while (count < limit) {
+    BlockPtr block = doc->block_at_line(line + count);
+    BlockPtr next_block = doc->block_at_line(line + count + 1);
+    if (!block || !next_block) {
       break;
+    }
+
+    BlockPtr previous_block = doc->block_at_line(line + count - 1);
+    if (!Textmate::run_parser((char *)block->text.c_str(), lang, block.get(),
+                              previous_block.get())) {
+      break;
+    }
+
+    count++;
+    if (!next_block->parser_state) {
+      break;
+    }
   }
-  textstyle_buffer[idx].start = 0;
-  textstyle_buffer[idx].length = 0;
 
-  return textstyle_buffer;
+  return count;
 }
 
 EXPORT
@@ -116,3 +702,19 @@ char *icon_for_filename(char *filename) {
 
 EXPORT
 int has_running_threads() { return Textmate::has_running_threads(); }
+
+// lines looked up in the memo of parsed lines, how many were found there
+// and how many lines it holds. any pointer may be NULL
+EXPORT
+void line_memo_stats(int64_t *lookups, int64_t *hits, int64_t *entries) {
+  line_memo_stats_t stats = Textmate::line_memo_stats();
+  if (lookups) {
+    *lookups = stats.lookups;
+  }
+  if (hits) {
+    *hits = stats.hits;
+  }
+  if (entries) {
+    *entries = stats.entries;
+  }
+}
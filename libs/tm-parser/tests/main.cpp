@@ -1,18 +1,41 @@
+#include <atomic>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <new>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "grammar.h"
 #include "parse.h"
+#include "pattern.h"
 #include "reader.h"
+#include "textmate.h"
 #include "theme.h"
 
 #include <time.h>
 
 using namespace parse;
 
+// heap allocations made through new, counted only while bench_match_arena
+// parses
+static std::atomic<bool> counting_allocations(false);
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    if (counting_allocations.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* res = malloc(size ? size : 1))
+        return res;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
 grammar_ptr load(std::string path)
 {
     Json::Value json = loadJson(path);
@@ -258,7 +281,7 @@ void test_stream()
     parse::stack_ptr parser_state = gm->seed();
 
     const char* cstr = content.c_str();
-    for (int i = 0; i < lineNo; i++) {
+    for (size_t i = 0; i < lineNo; i++) {
         const char* start = cstr + lines[i];
         size_t len = (cstr + lines[i + 1]) - start;
         std::string test = std::string(start, len);
@@ -275,6 +298,421 @@ void test_stream()
     // printf("%s\n", content.c_str());
 }
 
+// the grammars and files the benches run on
+struct bench_case_t {
+    const char* grammar;
+    const char* file;
+};
+
+static bench_case_t const bench_cases[] = {
+    { "extensions/cpp/syntaxes/cpp.tmLanguage.json", "tests/cases/test.c" },
+    { "extensions/cpp/syntaxes/cpp.tmLanguage.json", "tests/cases/test.cpp" },
+    { "extensions/cpp/syntaxes/cpp.tmLanguage.json", "tests/cases/tinywl.c" },
+    { "extensions/cpp/syntaxes/c.tmLanguage.json", "tests/cases/tinywl.c" },
+    { 0, 0 }
+};
+
+std::vector<std::string> load_lines(const char* path)
+{
+    std::vector<std::string> lines;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        lines.push_back(line + "\n");
+    }
+    return lines;
+}
+
+// parse the lines in order from the start of a file, keeping the scopes of
+// each line if asked
+void parse_lines(grammar_ptr gm, std::vector<std::string> const& lines,
+    std::vector<std::map<size_t, scope::scope_t>>* line_scopes = NULL)
+{
+    parse::stack_ptr parser_state = gm->seed();
+    bool firstLine = true;
+    for (std::string const& l : lines) {
+        std::map<size_t, scope::scope_t> scopes;
+        parser_state = parse::parse(l.c_str(), l.c_str() + l.length(), parser_state, scopes, firstLine);
+        if (line_scopes) {
+            line_scopes->push_back(scopes);
+        }
+        firstLine = false;
+    }
+}
+
+bool same_textstyles(std::vector<textstyle_t> const& lhs, std::vector<textstyle_t> const& rhs)
+{
+    return lhs.size() == rhs.size() && (lhs.empty() || memcmp(&lhs[0], &rhs[0], sizeof(textstyle_t) * lhs.size()) == 0);
+}
+
+// per-character span styling as done before textstyles_from_scopes
+// kept as a reference for bench_textstyles
+bool legacy_color_is_set(rgba_t clr)
+{
+    return clr.r >= 0 && (clr.r != 0 || clr.g != 0 || clr.b != 0 || clr.a != 0);
+}
+
+textstyle_t legacy_construct_style(std::vector<span_info_t>& spans, int index)
+{
+    textstyle_t res;
+    memset(&res, 0, sizeof(textstyle_t));
+    res.start = index;
+    res.length = 1;
+
+    for (auto span : spans) {
+        if (index >= span.start && index < span.start + span.length) {
+            if (!legacy_color_is_set({ res.r, res.g, res.b, 0 }) && legacy_color_is_set(span.fg)) {
+                res.r = span.fg.r;
+                res.g = span.fg.g;
+                res.b = span.fg.b;
+                res.a = span.fg.a;
+            }
+            res.italic = res.italic || span.italic;
+            if (span.scope.find("comment.block") == 0) {
+                res.flags = res.flags | SCOPE_COMMENT_BLOCK;
+            }
+            if (span.scope.find("string.quoted") == 0) {
+                res.flags = res.flags | SCOPE_STRING;
+            }
+        }
+    }
+    return res;
+}
+
+void legacy_textstyles(std::map<size_t, scope::scope_t>& scopes, size_t length, theme_ptr theme,
+    theme_info_t& info, std::vector<textstyle_t>& textstyles)
+{
+    std::vector<span_info_t> spans;
+    std::map<size_t, scope::scope_t>::iterator it = scopes.begin();
+    while (it != scopes.end()) {
+        size_t n = it->first;
+        std::string scopeName(it->second);
+        style_t style = theme->styles_for_scope(scopeName);
+        span_info_t span = { .start = (int32_t)n,
+            .length = (int32_t)(length - n),
+            .fg = { (int16_t)(255 * style.foreground.red),
+                (int16_t)(255 * style.foreground.green),
+                (int16_t)(255 * style.foreground.blue),
+                (int16_t)style.foreground.index },
+            .bg = { 0, 0, 0, 0 },
+            .bold = style.bold == bool_true,
+            .italic = style.italic == bool_true,
+            .underline = style.underlined == bool_true,
+            .scope = it->second.back() };
+        if (spans.size() > 0) {
+            spans.back().length = n - spans.back().start;
+        }
+        spans.push_back(span);
+        it++;
+    }
+
+    for (size_t i = 0; i < length && i < 512; i++) {
+        textstyle_t ts = legacy_construct_style(spans, i);
+        if (!legacy_color_is_set({ ts.r, ts.g, ts.b, 0 }) && ts.r + ts.g + ts.b == 0) {
+            ts.r = info.fg_r;
+            ts.g = info.fg_g;
+            ts.b = info.fg_b;
+            ts.a = info.fg_a;
+        }
+        if (textstyles.size() > 0) {
+            textstyle_t& prev = textstyles.back();
+            if (memcmp(&prev.flags, &ts.flags, sizeof(textstyle_t) - offsetof(textstyle_t, flags)) == 0) {
+                prev.length++;
+                continue;
+            }
+        }
+        textstyles.push_back(ts);
+    }
+}
+
+// the benches below return false when the two ways they compare differ
+
+bool bench_textstyles(int reps)
+{
+    Json::Value root = parse::loadJson("test-cases/themes/light_vs.json");
+    theme_ptr theme = parse_theme(root);
+
+    compiled_theme_t compiled(theme);
+    theme_info_t& info = compiled.info;
+
+    bool res = true;
+    for (int c = 0; bench_cases[c].grammar != 0; c++) {
+        // parse once, only the span building is timed
+        std::vector<std::string> lines = load_lines(bench_cases[c].file);
+        std::vector<std::map<size_t, scope::scope_t>> line_scopes;
+        parse_lines(load(bench_cases[c].grammar), lines, &line_scopes);
+        std::vector<parse::scope_runs_t> line_runs;
+        for (auto const& scopes : line_scopes) {
+            line_runs.push_back(parse::scope_runs_t(scopes.begin(), scopes.end()));
+        }
+
+        bool same = true;
+        double elapsed[2];
+        for (int pass = 0; pass < 2; pass++) {
+            clock_t start = clock();
+            for (int r = 0; r < reps; r++) {
+                for (size_t i = 0; i < lines.size(); i++) {
+                    std::vector<textstyle_t> textstyles;
+                    if (pass == 0) {
+                        legacy_textstyles(line_scopes[i], lines[i].length(), theme, info, textstyles);
+                    } else {
+                        textstyles_from_scopes(line_runs[i], lines[i].length(), compiled, textstyles);
+                    }
+                    if (r == 0 && pass == 1) {
+                        std::vector<textstyle_t> expected;
+                        legacy_textstyles(line_scopes[i], lines[i].length(), theme, info, expected);
+                        same = same && same_textstyles(expected, textstyles);
+                    }
+                }
+            }
+            elapsed[pass] = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+        }
+
+        std::cout << bench_cases[c].grammar << " " << bench_cases[c].file << " x " << reps
+                  << " per-char:" << elapsed[0] << "s sweep:" << elapsed[1] << "s"
+                  << (same ? "" : " MISMATCH") << std::endl;
+        res = res && same;
+    }
+    return res;
+}
+
+void bench_parse(int reps)
+{
+    for (int c = 0; bench_cases[c].grammar != 0; c++) {
+        grammar_ptr gm = load(bench_cases[c].grammar);
+        std::vector<std::string> lines = load_lines(bench_cases[c].file);
+
+        // the first pass warms up the candidate lists
+        double elapsed = 0;
+        for (int r = 0; r <= reps; r++) {
+            clock_t start = clock();
+            parse_lines(gm, lines);
+            if (r > 0) {
+                elapsed += ((double)(clock() - start)) / CLOCKS_PER_SEC;
+            }
+        }
+
+        std::cout << bench_cases[c].grammar << " " << bench_cases[c].file << " x " << reps
+                  << " parse:" << elapsed << "s" << std::endl;
+    }
+}
+
+bool bench_prefilter(int reps)
+{
+    bool res = true;
+    for (int c = 0; bench_cases[c].grammar != 0; c++) {
+        grammar_ptr gm = load(bench_cases[c].grammar);
+        std::vector<std::string> lines = load_lines(bench_cases[c].file);
+
+        double elapsed[2];
+        size_t searched = 0;
+        size_t skipped = 0;
+        std::vector<std::map<size_t, scope::scope_t>> line_scopes[2];
+        for (int pass = 0; pass < 2; pass++) {
+            regexp::set_prefilter_enabled(pass == 1);
+            size_t searched_before = gm->prefilter_stats().searched;
+            size_t skipped_before = gm->prefilter_stats().skipped;
+            clock_t start = clock();
+            for (int r = 0; r < reps; r++) {
+                parse_lines(gm, lines, r == 0 ? &line_scopes[pass] : NULL);
+            }
+            elapsed[pass] = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+            searched = gm->prefilter_stats().searched - searched_before;
+            skipped = gm->prefilter_stats().skipped - skipped_before;
+        }
+        regexp::set_prefilter_enabled(true);
+
+        bool same = line_scopes[0] == line_scopes[1];
+        std::cout << bench_cases[c].grammar << " " << bench_cases[c].file << " x " << reps
+                  << " searched:" << searched << " skipped:" << skipped
+                  << " unfiltered:" << elapsed[0] << "s filtered:" << elapsed[1] << "s"
+                  << (same ? "" : " MISMATCH") << std::endl;
+        res = res && same;
+    }
+    return res;
+}
+
+bool bench_match_arena(int reps)
+{
+    bool res = true;
+    for (int c = 0; bench_cases[c].grammar != 0; c++) {
+        grammar_ptr gm = load(bench_cases[c].grammar);
+        std::vector<std::string> lines = load_lines(bench_cases[c].file);
+
+        // the first pass of each warms up candidate lists and pools
+        double per_line = (double)reps * lines.size();
+        std::vector<std::map<size_t, scope::scope_t>> line_scopes[2];
+        for (int pass = 0; pass < 2; pass++) {
+            regexp::set_match_arena_enabled(pass == 1);
+            double elapsed = 0;
+            size_t allocated = 0;
+            size_t regions = 0;
+            for (int r = 0; r <= reps; r++) {
+                allocations = 0;
+                regexp::match_arena_stats_t before = regexp::match_arena_stats();
+                clock_t start = clock();
+                counting_allocations = r > 0;
+                parse_lines(gm, lines, r == 0 ? &line_scopes[pass] : NULL);
+                counting_allocations = false;
+                if (r > 0) {
+                    regexp::match_arena_stats_t after = regexp::match_arena_stats();
+                    elapsed += ((double)(clock() - start)) / CLOCKS_PER_SEC;
+                    allocated += allocations;
+                    regions += (after.regions - after.regions_reused) - (before.regions - before.regions_reused);
+                }
+            }
+
+            std::cout << bench_cases[c].grammar << " " << bench_cases[c].file
+                      << (pass == 1 ? " arena" : " heap")
+                      << " new/line:" << allocated / per_line
+                      << " regions/line:" << regions / per_line
+                      << " us/line:" << elapsed * 1000000 / per_line << std::endl;
+        }
+        regexp::set_match_arena_enabled(true);
+
+        bool same = line_scopes[0] == line_scopes[1];
+        if (!same) {
+            std::cout << bench_cases[c].grammar << " " << bench_cases[c].file << " MISMATCH" << std::endl;
+        }
+        res = res && same;
+    }
+    return res;
+}
+
+bool bench_restyle(int reps)
+{
+    int themes[] = { Textmate::load_theme("test-cases/themes/light_vs.json"),
+        Textmate::load_theme("test-cases/themes/dark_vs.json") };
+
+    bool res = true;
+    for (int c = 0; bench_cases[c].grammar != 0; c++) {
+        language_info_ptr lang = std::make_shared<language_info_t>();
+        lang->grammar = load(bench_cases[c].grammar);
+
+        // run_highlighter adds the newline
+        std::vector<std::string> lines = load_lines(bench_cases[c].file);
+        for (std::string& l : lines) {
+            l.erase(l.length() - 1);
+        }
+
+        // the first pass parses, the others only switch theme
+        double elapsed[2] = { 0, 0 };
+        std::vector<block_data_t> blocks(lines.size());
+        for (int r = 0; r <= reps; r++) {
+            Textmate::set_theme(themes[r % 2]);
+            clock_t start = clock();
+            for (size_t i = 0; i < lines.size(); i++) {
+                Textmate::run_highlighter((char*)lines[i].c_str(), lang, Textmate::theme(),
+                    &blocks[i], i > 0 ? &blocks[i - 1] : NULL);
+            }
+            elapsed[r > 0] += ((double)(clock() - start)) / CLOCKS_PER_SEC;
+        }
+
+        // restyled lines match lines parsed with that theme
+        bool same = true;
+        std::vector<block_data_t> fresh(lines.size());
+        for (size_t i = 0; i < lines.size(); i++) {
+            std::vector<textstyle_t> expected = Textmate::run_highlighter((char*)lines[i].c_str(), lang,
+                Textmate::theme(), &fresh[i], i > 0 ? &fresh[i - 1] : NULL);
+            std::vector<textstyle_t> textstyles = Textmate::run_highlighter((char*)lines[i].c_str(), lang,
+                Textmate::theme(), &blocks[i], i > 0 ? &blocks[i - 1] : NULL);
+            same = same && same_textstyles(expected, textstyles);
+        }
+
+        std::cout << bench_cases[c].grammar << " " << bench_cases[c].file << " x " << reps
+                  << " parse:" << elapsed[0] << "s restyle:" << elapsed[1] / reps << "s"
+                  << (same ? "" : " MISMATCH") << std::endl;
+        res = res && same;
+    }
+    return res;
+}
+
+void bench_pattern_registry()
+{
+    const char* grammars[] = { "extensions/cpp/syntaxes/c.tmLanguage.json",
+        "extensions/cpp/syntaxes/cpp.tmLanguage.json",
+        "extensions/cpp/syntaxes/cpp.embedded.macro.tmLanguage.json",
+        "extensions/cpp/syntaxes/platform.tmLanguage.json",
+        0 };
+
+    // patterns are compiled as grammars load, as they would be if all
+    // their rules were reached
+    regexp::set_deferred_patterns_enabled(false);
+    for (int pass = 0; pass < 2; pass++) {
+        regexp::set_pattern_registry_enabled(pass == 1);
+        regexp::pattern_registry_stats_t before = regexp::pattern_registry_stats();
+        std::vector<grammar_ptr> loaded;
+        clock_t start = clock();
+        for (int g = 0; grammars[g] != 0; g++) {
+            loaded.push_back(load(grammars[g]));
+        }
+        double elapsed = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+        regexp::pattern_registry_stats_t after = regexp::pattern_registry_stats();
+
+        std::cout << (pass == 1 ? "shared" : "unshared")
+                  << " load:" << elapsed << "s"
+                  << " compiled:" << after.compiled - before.compiled
+                  << " shared:" << after.shared - before.shared
+                  << " bytes:" << after.bytes_compiled - before.bytes_compiled
+                  << " bytes saved:" << after.bytes_saved - before.bytes_saved
+                  << " compile:" << after.seconds_compiled - before.seconds_compiled << "s"
+                  << " saved:" << after.seconds_saved - before.seconds_saved << "s"
+                  << std::endl;
+    }
+    regexp::set_pattern_registry_enabled(true);
+    regexp::set_deferred_patterns_enabled(true);
+}
+
+// rule ids differ between reads
+static void strip_rule_ids(Json::Value& json)
+{
+    if (json.isObject()) {
+        json.removeMember("_id");
+        for (auto const& name : json.getMemberNames()) {
+            strip_rule_ids(json[name]);
+        }
+    } else if (json.isArray()) {
+        for (auto& item : json) {
+            strip_rule_ids(item);
+        }
+    }
+}
+
+bool bench_grammar_reader()
+{
+    const char* grammars[] = { "extensions/cpp/syntaxes/c.tmLanguage.json",
+        "extensions/cpp/syntaxes/cpp.tmLanguage.json",
+        "extensions/cpp/syntaxes/cpp.embedded.macro.tmLanguage.json",
+        "extensions/cpp/syntaxes/platform.tmLanguage.json",
+        0 };
+
+    bool res = true;
+    double streamed = 0;
+    double converted = 0;
+    for (int g = 0; grammars[g] != 0; g++) {
+        clock_t start = clock();
+        rule_ptr rule = std::make_shared<rule_t>();
+        bool read = read_rules(grammars[g], rule);
+        streamed += ((double)(clock() - start)) / CLOCKS_PER_SEC;
+
+        start = clock();
+        Json::Value json = loadJson(grammars[g]);
+        rule_ptr reference = convert_json(json);
+        converted += ((double)(clock() - start)) / CLOCKS_PER_SEC;
+
+        Json::Value lhs = rule_to_json(rule);
+        Json::Value rhs = rule_to_json(reference);
+        strip_rule_ids(lhs);
+        strip_rule_ids(rhs);
+        bool same = read && lhs == rhs;
+        std::cout << grammars[g] << (same ? " same" : " MISMATCH") << std::endl;
+        res = res && same;
+    }
+    std::cout << "streamed:" << streamed << "s converted:" << converted << "s" << std::endl;
+    return res;
+}
+
+// the checks run once by default, "bench" times them over more passes
 int main(int argc, char** argv)
 {
     clock_t start, end;
@@ -282,19 +720,38 @@ int main(int argc, char** argv)
     start = clock();
 
     int lines = 1;
+    bool bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    int reps = bench ? 20 : 1;
 
     // test_read_and_parse();
     // test_hello();
     // test_coffee();
-    lines = test_c();
+    if (!bench) {
+        lines = test_c();
+    }
     // test_stream();
 
     // test_markdown();
     // test_plist();
 
+    int failed = 0;
+    failed += !bench_textstyles(reps);
+    failed += !bench_prefilter(reps);
+    failed += !bench_match_arena(reps);
+    failed += !bench_restyle(reps);
+    failed += !bench_grammar_reader();
+    if (bench) {
+        bench_parse(reps);
+        bench_pattern_registry();
+    }
+
     end = clock();
     cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
     std::cout << std::endl
               << "done in " << cpu_time_used << "s " << (cpu_time_used/lines) << "s/line" << std::endl;
+    if (failed) {
+        std::cout << failed << " checks failed" << std::endl;
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -31,6 +31,13 @@ static bool file_exists(const char* path)
 void parseXMLElement(Json::Value& target, tinyxml2::XMLElement* element);
 void parseXMLElementArray(Json::Value& target, tinyxml2::XMLElement* element);
 
+// GetText is null for an empty element such as <string/>
+static const char* elementText(tinyxml2::XMLElement* element)
+{
+    const char* text = element->GetText();
+    return text ? text : "";
+}
+
 void parseXMLElementArray(Json::Value& target, tinyxml2::XMLElement* element)
 {
     if (!element)
@@ -40,7 +47,7 @@ void parseXMLElementArray(Json::Value& target, tinyxml2::XMLElement* element)
     while (pChild) {
         std::string name = pChild->Name();
         if (name == "string") {
-            target[idx++] = pChild->GetText();
+            target[idx++] = elementText(pChild);
         }
         if (name == "dict") {
             Json::Value val;
@@ -66,10 +73,10 @@ void parseXMLElement(Json::Value& target, tinyxml2::XMLElement* element)
     while (pChild) {
         std::string name = pChild->Name();
         if (name == "key") {
-            key = pChild->GetText();
+            key = elementText(pChild);
         }
         if (name == "string") {
-            std::string v = pChild->GetText();
+            std::string v = elementText(pChild);
             target[key.c_str()] = v.c_str();
         }
         if (name == "dict") {
@@ -414,7 +421,7 @@ language_from_file(const std::string path,
                 log("grammar: %s", path.c_str());
                 log("extension: %s", resolvedExtension.path.c_str());
 
-                lang->grammar = parse::parse_grammar(load_plist_or_json(path));
+                lang->grammar = parse::parse_grammar_file(path);
                 lang->id = resolvedLanguage;
 
                 // language configuration
@@ -1,8 +1,17 @@
+#include <algorithm>
 #include <cstring>
+#include <deque>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
 #include <vector>
 
+#ifdef WIN64
+#include <direct.h>
+#endif
+
 #include "extension.h"
 #include "grammar.h"
 #include "onigmognu.h"
@@ -20,21 +29,153 @@ void set_extensions(extension_list* exts)
     extensions = exts;
 }
 
-int grammar_t::running_threads = 0;
+// directory of cached rule trees, empty if grammars are not cached
+static std::string grammar_cache;
+
+void set_grammar_cache(std::string const& directory)
+{
+    grammar_cache = directory;
+    if (!grammar_cache.empty()) {
+#ifdef WIN64
+        _mkdir(grammar_cache.c_str());
+#else
+        mkdir(grammar_cache.c_str(), 0755);
+#endif
+    }
+}
+
+static std::string grammar_cache_path(std::string const& path)
+{
+    if (grammar_cache.empty() || path.empty()) {
+        return "";
+    }
+    std::ostringstream ss;
+    ss << grammar_cache << "/" << std::hex << std::hash<std::string>()(path) << ".tmgc";
+    return ss.str();
+}
+
+// read the rules of a grammar file into target, from the cache if the
+// file is unchanged since it was cached. files the streaming readers do not
+// take go through a document
+static void load_rules(std::string const& path, rule_ptr const& target)
+{
+    std::string cache = grammar_cache_path(path);
+    if (!cache.empty() && read_cached_rules(cache, path, target)) {
+        return;
+    }
+
+    if (!read_rules(path, target)) {
+        Json::Value json = load_plist_or_json(path);
+        convert_json(json, target);
+    }
+    if (!cache.empty()) {
+        write_cached_rules(cache, path, target);
+    }
+}
+
+// =====================
+// = Grammar task pool =
+// =====================
+
+namespace {
+// a few threads loading grammars included by others, in the order they
+// are found. tasks do not wait for each other
+struct task_pool_t {
+    task_pool_t(unsigned threads)
+    {
+        for (unsigned i = 0; i < threads; i++) {
+            pthread_t thread_id;
+            pthread_create(&thread_id, NULL, &worker, (void*)this);
+            pthread_detach(thread_id);
+        }
+    }
+
+    void run(std::function<void()> const& task)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(task);
+        queued.notify_one();
+    }
 
+    static void* worker(void* arg)
+    {
+        task_pool_t* pool = (task_pool_t*)arg;
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(pool->mutex);
+                pool->queued.wait(lock, [pool]() { return !pool->tasks.empty(); });
+                task = pool->tasks.front();
+                pool->tasks.pop_front();
+            }
+            task();
+        }
+        return NULL;
+    }
+
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<std::function<void()>> tasks;
+};
+
+// never destroyed, its threads run until the process ends
+task_pool_t& grammar_pool()
+{
+    static task_pool_t* pool = new task_pool_t(
+        std::max(2u, std::min(4u, std::thread::hardware_concurrency())));
+    return *pool;
+}
+} // namespace
+
+std::atomic<int> grammar_t::running_threads(0);
+
+// the grammar itself counts as a load until its constructor is done
 grammar_t::grammar_t(Json::Value const& json)
+    : _prefilter_stats(std::make_shared<regexp::prefilter_stats_t>())
+    , _loading(1)
+    , _ready(false)
 {
+    running_threads++;
     std::string scopeName = json["scopeName"].asString();
     _rule = add_grammar(scopeName, json);
+    loaded();
+}
 
-    // Json::Value parsed = rule_to_json(_rule);
-    // std::cout << parsed << std::endl;
-    // doc = parsed;
+grammar_t::grammar_t(std::string const& path)
+    : _prefilter_stats(std::make_shared<regexp::prefilter_stats_t>())
+    , _loading(1)
+    , _ready(false)
+{
+    running_threads++;
+    rule_ptr grammar = std::make_shared<rule_t>();
+    load_rules(path, grammar);
+    _rule = add_rules(grammar->scope_string, grammar, "");
+    loaded();
+}
 
-    doc = json;
+// loads still running use the grammar
+grammar_t::~grammar_t()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]() { return _loading == 0; });
 }
 
-grammar_t::~grammar_t() {}
+Json::Value grammar_t::document()
+{
+    return rule_to_json(_rule);
+}
+
+void grammar_t::on_ready(std::function<void()> const& callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_ready) {
+            _ready_callbacks.push_back(callback);
+            return;
+        }
+    }
+    callback();
+}
 
 static bool pattern_has_back_reference(std::string const& ptrn)
 {
@@ -65,10 +206,29 @@ static bool pattern_has_anchor(std::string const& ptrn)
 // = grammar_t =
 // =============
 
-static void compile_patterns(rule_t* rule)
+// patterns are compiled when the parser first tries them, most rules of
+// a large grammar are never reached
+static void compile_patterns(rule_t* rule, regexp::prefilter_stats_ptr const& stats,
+    std::atomic<bool> const* ready);
+
+static rule_t* find_repository_item(rule_t const* rule, std::string const& name)
+{
+    if (rule->repository) {
+        auto it = rule->repository->find(name);
+        if (it != rule->repository->end())
+            return it->second.get();
+    }
+    return nullptr;
+}
+
+static void compile_patterns(rule_t* rule, regexp::prefilter_stats_ptr const& stats,
+    std::atomic<bool> const* ready)
 {
+    rule->ready = ready;
+
     if (rule->match_string != NULL_STR) {
-        rule->match_pattern = regexp::pattern_t(rule->match_string);
+        rule->match_pattern = regexp::pattern_t(rule->match_string, ONIG_OPTION_NONE, true);
+        rule->match_pattern.analyse(stats);
         rule->match_pattern_is_anchored = pattern_has_anchor(rule->match_string);
         // if(!rule->match_pattern)
         //   os_log_error(OS_LOG_DEFAULT, "Bad begin/match pattern for %{public}s",
@@ -76,21 +236,23 @@ static void compile_patterns(rule_t* rule)
     }
 
     if (rule->while_string != NULL_STR && !pattern_has_back_reference(rule->while_string)) {
-        rule->while_pattern = regexp::pattern_t(rule->while_string);
+        rule->while_pattern = regexp::pattern_t(rule->while_string, ONIG_OPTION_NONE, true);
+        rule->while_pattern.analyse(stats);
         // if(!rule->while_pattern)
         //   os_log_error(OS_LOG_DEFAULT, "Bad while pattern for %{public}s",
         //   rule->scope_string.c_str());
     }
 
     if (rule->end_string != NULL_STR && !pattern_has_back_reference(rule->end_string)) {
-        rule->end_pattern = regexp::pattern_t(rule->end_string);
+        rule->end_pattern = regexp::pattern_t(rule->end_string, ONIG_OPTION_NONE, true);
+        rule->end_pattern.analyse(stats);
         // if(!rule->end_pattern)
         //   os_log_error(OS_LOG_DEFAULT, "Bad end pattern for %{public}s",
         //   rule->scope_string.c_str());
     }
 
     for (rule_ptr child : rule->children)
-        compile_patterns(child.get());
+        compile_patterns(child.get(), stats, ready);
 
     repository_ptr maps[] = { rule->repository, rule->injection_rules,
         rule->captures, rule->begin_captures,
@@ -100,7 +262,7 @@ static void compile_patterns(rule_t* rule)
             continue;
 
         for (auto const& pair : *map)
-            compile_patterns(pair.second.get());
+            compile_patterns(pair.second.get(), stats, ready);
     }
 
     // if (rule->injection_rules)
@@ -120,28 +282,23 @@ void grammar_t::setup_includes(rule_ptr const& rule, rule_ptr const& base,
     } else if (include == "$self") {
         rule->include = self.get();
     } else if (include != NULL_STR) {
-        static auto find_repository_item = [](rule_t const* rule,
-                                               std::string const& name) -> rule_t* {
-            if (rule->repository) {
-                auto it = rule->repository->find(name);
-                if (it != rule->repository->end())
-                    return it->second.get();
-            }
-            return nullptr;
-        };
-
         if (include[0] == '#') {
             std::string const name = include.substr(1);
             for (rule_stack_t const* node = &stack; node && !rule->include;
                  node = node->parent)
                 rule->include = find_repository_item(node->rule, name);
         } else {
+            // the repository of a grammar may still be loading
             std::string::size_type fragment = include.find('#');
-            if (rule_ptr grammar = find_grammar(include.substr(0, fragment), base))
-                rule->include = fragment == std::string::npos
-                    ? grammar.get()
-                    : find_repository_item(
-                        grammar.get(), include.substr(fragment + 1));
+            if (rule_ptr grammar = find_grammar(include.substr(0, fragment), base)) {
+                if (fragment == std::string::npos) {
+                    rule->include = grammar.get();
+                } else {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    link_t link = { rule.get(), grammar, include.substr(fragment + 1) };
+                    _links.push_back(link);
+                }
+            }
         }
 
         if (!rule->include) {
@@ -198,9 +355,12 @@ grammar_t::injection_grammars()
 rule_ptr grammar_t::find_grammar(std::string const& scope,
     rule_ptr const& base)
 {
-    auto it = _grammars.find(scope);
-    if (it != _grammars.end())
-        return it->second;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _grammars.find(scope);
+        if (it != _grammars.end())
+            return it->second;
+    }
 
     if (extensions != nullptr) {
         bool found = false;
@@ -227,88 +387,92 @@ rule_ptr grammar_t::find_grammar(std::string const& scope,
     return nullptr;
 }
 
-void* grammar_t::setup_includes_thread(void* arg)
+void grammar_t::load_included(rule_ptr const& grammar, std::string const& path,
+    rule_ptr const& base)
 {
-    grammar_t::setup_includes_payload_t* p = (grammar_t::setup_includes_payload_t*)arg;
-    if (p->path != "") {
-        Json::Value json = load_plist_or_json(p->path);
-        convert_json(json, p->self);
-    }
-    compile_patterns(p->self.get());
-    p->_this->setup_includes(p->rule, p->base, p->self, p->stack);
-    delete p;
-    running_threads--;
-    return NULL;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _loading++;
+    }
+    running_threads++;
+
+    grammar_t* self = this;
+    grammar_pool().run([self, grammar, path, base]() {
+        if (path != "") {
+            load_rules(path, grammar);
+        }
+        compile_patterns(grammar.get(), self->_prefilter_stats, &self->_ready);
+        self->setup_includes(grammar, base, grammar, rule_stack_t(grammar.get()));
+        self->loaded();
+    });
 }
 
-rule_ptr grammar_t::add_grammar(std::string const& scope,
-    Json::Value const& json, rule_ptr const& base, bool spawn_thread)
+// the last load to finish resolves the links, no other load then changes
+// the rules. running_threads drops after, none running means all are ready
+void grammar_t::loaded()
 {
-    #ifdef DISABLE_ADD_GRAMMAR_THREADS
-    spawn_thread = false;
-    #endif
-
-    rule_ptr grammar = convert_json(json);
-    if (grammar) {
-        _grammars.emplace(scope, grammar);
-
-        if (spawn_thread) {
-            setup_includes_payload_t* p = new setup_includes_payload_t();
-            p->_this = this;
-            p->rule = grammar;
-            p->base = base ? base : grammar;
-            p->self = grammar;
-            p->stack = rule_stack_t(grammar.get());
-            running_threads++;
-            pthread_t thread_id;
-            pthread_create(&thread_id, NULL,
-                &setup_includes_thread, (void*)(p));
-
-        } else {
-            compile_patterns(grammar.get());
-            setup_includes(grammar, base ? base : grammar, grammar,
-                rule_stack_t(grammar.get()));
+    std::vector<std::function<void()>> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_loading == 0) {
+            for (link_t const& link : _links) {
+                link.rule->include = find_repository_item(link.grammar.get(), link.name);
+            }
+            _links.clear();
+            _ready = true;
+            callbacks.swap(_ready_callbacks);
+            _idle.notify_all();
         }
     }
+    running_threads--;
 
-    return grammar;
+    for (auto const& callback : callbacks) {
+        callback();
+    }
+}
+
+rule_ptr grammar_t::add_grammar(std::string const& scope,
+    Json::Value const& json, rule_ptr const& base, bool spawn_thread)
+{
+    return add_rules(scope, convert_json(json), "", base, spawn_thread);
 }
 
 rule_ptr grammar_t::add_grammar(std::string const& scope, std::string const& path,
     rule_ptr const& base, bool spawn_thread)
+{
+    return add_rules(scope, std::make_shared<rule_t>(), path, base, spawn_thread);
+}
+
+rule_ptr grammar_t::add_rules(std::string const& scope, rule_ptr const& grammar,
+    std::string const& path, rule_ptr const& base, bool spawn_thread)
 {
     #ifdef DISABLE_ADD_GRAMMAR_THREADS
     spawn_thread = false;
     #endif
 
-    rule_ptr grammar = std::make_shared<rule_t>();
-    if (grammar) {
-        _grammars.emplace(scope, grammar);
-
-        if (spawn_thread) {
-            setup_includes_payload_t* p = new setup_includes_payload_t();
-            p->_this = this;
-            p->rule = grammar;
-            p->base = base ? base : grammar;
-            p->self = grammar;
-            p->stack = rule_stack_t(grammar.get());
-            p->path = path;
-            running_threads++;
-            pthread_t thread_id;
-            pthread_create(&thread_id, NULL,
-                &setup_includes_thread, (void*)(p));
+    if (!grammar) {
+        return grammar;
+    }
 
-        } else {
-            if (path != "") {
-                Json::Value json = load_plist_or_json(path);
-                convert_json(json, grammar);
-            }
-            compile_patterns(grammar.get());
-            setup_includes(grammar, base ? base : grammar, grammar,
-                rule_stack_t(grammar.get()));
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _grammars.emplace(scope, grammar);
+        if (!it.second) {
+            return it.first->second;
         }
     }
 
+    if (spawn_thread) {
+        load_included(grammar, path, base ? base : grammar);
+    } else {
+        if (path != "") {
+            load_rules(path, grammar);
+        }
+        compile_patterns(grammar.get(), _prefilter_stats, &_ready);
+        setup_includes(grammar, base ? base : grammar, grammar,
+            rule_stack_t(grammar.get()));
+    }
+
     return grammar;
 }
 
@@ -323,6 +487,11 @@ grammar_ptr parse_grammar(Json::Value const& json)
     return std::make_shared<grammar_t>(json);
 }
 
+grammar_ptr parse_grammar_file(std::string const& path)
+{
+    return std::make_shared<grammar_t>(path);
+}
+
 rule_ptr rule_find_rule(rule_ptr rule, int rule_id)
 {
     if (rule->rule_id == rule_id) {
@@ -1,6 +1,9 @@
 #ifndef PARSE_GRAMMAR_H
 #define PARSE_GRAMMAR_H
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -21,13 +24,23 @@ typedef std::shared_ptr<stack_t> stack_ptr;
 struct grammar_t {
 
     grammar_t(Json::Value const& json);
+    grammar_t(std::string const& path);
     ~grammar_t();
 
     stack_ptr seed() const;
-    std::mutex& mutex() { return _mutex; }
-    Json::Value document() { return doc; }
+    regexp::prefilter_stats_t const& prefilter_stats() const { return *_prefilter_stats; }
+    // the rules as json, made on each call. the document a grammar is
+    // read from is not kept
+    Json::Value document();
 
-    static int running_threads;
+    // included grammars are loaded on a pool of threads. a grammar is ready
+    // once they are loaded and all its includes are resolved
+    bool ready() const { return _ready; }
+    // callback runs when the grammar is ready, at once if it is already
+    void on_ready(std::function<void()> const& callback);
+
+    // grammar loads not finished yet, of all grammars
+    static std::atomic<int> running_threads;
 
 private:
     struct rule_stack_t {
@@ -41,17 +54,18 @@ private:
         rule_stack_t const* parent;
     };
 
-    static void* setup_includes_thread(void* arg);
-
-    struct setup_includes_payload_t {
-        grammar_t* _this;
-        rule_ptr rule;
-        rule_ptr base;
-        rule_ptr self;
-        rule_stack_t stack;
-        std::string path;
+    // an include of a repository item of another grammar, resolved when
+    // the loads are done
+    struct link_t {
+        rule_t* rule;
+        rule_ptr grammar;
+        std::string name;
     };
 
+    void load_included(rule_ptr const& grammar, std::string const& path,
+        rule_ptr const& base);
+    void loaded();
+
     void setup_includes(rule_ptr const& rule, rule_ptr const& base,
         rule_ptr const& self, rule_stack_t const& stack);
     rule_ptr find_grammar(std::string const& scope, rule_ptr const& base);
@@ -59,19 +73,34 @@ private:
         rule_ptr const& base = rule_ptr(), bool spawn_thread = false);
     rule_ptr add_grammar(std::string const& scope, std::string const& path,
         rule_ptr const& base = rule_ptr(), bool spawn_thread = false);
+    rule_ptr add_rules(std::string const& scope, rule_ptr const& grammar,
+        std::string const& path, rule_ptr const& base = rule_ptr(),
+        bool spawn_thread = false);
 
     std::vector<std::pair<scope::selector_t, rule_ptr>> injection_grammars();
 
     rule_ptr _rule;
-    std::mutex _mutex;
+    regexp::prefilter_stats_ptr _prefilter_stats;
     std::map<std::string, rule_ptr> _grammars;
-    Json::Value doc;
+
+    // held while _grammars, _links or the load state are read or changed
+    std::mutex _mutex;
+    std::condition_variable _idle;
+    int _loading;
+    std::atomic<bool> _ready;
+    std::vector<link_t> _links;
+    std::vector<std::function<void()>> _ready_callbacks;
 
     rule_ptr find_rule(grammar_t* grammar, int id);
 };
 
 typedef std::shared_ptr<grammar_t> grammar_ptr;
 grammar_ptr parse_grammar(Json::Value const& json);
+grammar_ptr parse_grammar_file(std::string const& path);
+
+// cache the rules of grammar files loaded by path in directory, which is
+// created if missing. set before grammars are loaded
+void set_grammar_cache(std::string const& directory);
 
 } // namespace parse
 
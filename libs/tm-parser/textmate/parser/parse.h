@@ -1,6 +1,7 @@
 #ifndef PARSE_PARSE_H
 #define PARSE_PARSE_H
 
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
@@ -13,10 +14,35 @@ namespace parse {
 struct stack_t;
 typedef std::shared_ptr<stack_t> stack_ptr;
 
+// a line as runs of scopes, by the position each run starts at
+typedef std::vector<std::pair<size_t, scope::scope_t>> scope_runs_t;
+
 void set_extensions(extension_list* extensions);
 
 stack_ptr parse(char const* first, char const* last, stack_ptr stack,
     std::map<size_t, scope::scope_t>& scopes, bool firstLine);
+// parse a line in steps, from offset up to about stop. offset is moved to
+// where parsing ended, the line is done once it reaches last - first.
+// resume with the returned state and the same line
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    std::map<size_t, scope::scope_t>& scopes, bool firstLine, size_t& offset,
+    size_t stop);
+
+// the same, filling runs in position order. runs is cleared first, its
+// storage and the parser's buffers are reused from line to line
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    scope_runs_t& runs, bool firstLine);
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    scope_runs_t& runs, bool firstLine, size_t& offset, size_t stop);
+// a line from offset, 0 or where a checkpoint of it was taken, to its end.
+// checkpoint is given states the line passes through at least step bytes
+// apart, where the parser collects its rules again: a parse resumed from
+// one goes on as this one does. when it returns true the parse stops
+// there, offset is set to where the parse ended
+typedef std::function<bool(size_t offset, stack_ptr const& state)> checkpoint_fn;
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    scope_runs_t& runs, bool firstLine, size_t& offset, size_t step,
+    checkpoint_fn const& checkpoint);
 bool equal(stack_ptr lhs, stack_ptr rhs);
 
 } // namespace parse
@@ -1,16 +1,26 @@
 #include "grammar.h"
 #include "parse.h"
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <list>
 #include <map>
-#include <set>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "onigmognu.h"
 
 static size_t const kParserMaxLineSize = 4096;
+static size_t const kMaxDynamicPatterns = 256;
+static size_t const kMaxInjectedScopes = 256;
+
+static size_t hash_combine(size_t seed, size_t hash)
+{
+    return seed ^ (hash + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
 
 namespace {
 
@@ -25,22 +35,32 @@ static std::string replace_in_string(std::string str, std::string from,
     return str;
 }
 
+// the scopes added and removed while parsing a line, as a flat list of
+// events over interned atoms. the storage is reused from line to line
 struct scopes_t {
     void add(size_t pos, std::string const& scope)
     {
+        scope::atom_t atom = scope::scope_t::intern(scope);
         if (tracking)
-            stack.push_back(scope);
+            stack.push_back(atom);
 
-        map.emplace(pos, record_t(scope, true));
+        events.push_back(event_t{ pos, (ssize_t)events.size(), atom, true });
     }
 
     void remove(size_t pos, std::string const& scope, bool endRule = false)
     {
-        map.emplace_hint(endRule ? map.end() : map.lower_bound(pos), pos,
-            record_t(scope, false));
+        remove(pos, scope::scope_t::intern(scope), endRule);
+    }
+
+    void remove(size_t pos, scope::atom_t atom, bool endRule = false)
+    {
+        // removals not ending a rule come before anything else at pos,
+        // the latest first
+        ssize_t rank = endRule ? (ssize_t)events.size() : -(ssize_t)events.size() - 1;
+        events.push_back(event_t{ pos, rank, atom, false });
 
         if (tracking) {
-            if (!stack.empty() && stack.back() == scope)
+            if (!stack.empty() && stack.back() == atom)
                 stack.pop_back();
             // else  // os_log_error(OS_LOG_DEFAULT, "Unbalanced scope removal:
             // %{public}s, on stack: %{public}s", scope.c_str(), text::join(stack, "
@@ -48,29 +68,44 @@ struct scopes_t {
         }
     }
 
-    scope::scope_t update(scope::scope_t scope,
-        std::map<size_t, scope::scope_t>& out) const
+    void clear()
+    {
+        events.clear();
+        stack.clear();
+        tracking = 0;
+    }
+
+    scope::scope_t update(scope::scope_t scope, parse::scope_runs_t& out,
+        size_t from = 0)
     {
-        size_t pos = 0;
-        for (auto const& pair : map) {
-            // D(DBF_Parser, bug("%3zu: %c%s\n", pair.first, pair.second.add ? '+' :
-            // '-', pair.second.scope.c_str()););
-            if (pos != pair.first) {
-                out.emplace(pos, scope);
-                pos = pair.first;
+        struct helper_t {
+            static bool less(event_t const& lhs, event_t const& rhs)
+            {
+                return lhs.pos < rhs.pos || (lhs.pos == rhs.pos && lhs.rank < rhs.rank);
+            }
+        };
+        std::sort(events.begin(), events.end(), &helper_t::less);
+
+        size_t pos = from;
+        for (event_t const& event : events) {
+            // D(DBF_Parser, bug("%3zu: %c%s\n", event.pos, event.add ? '+' :
+            // '-', event.atom->c_str()););
+            if (pos != event.pos) {
+                out.emplace_back(pos, scope);
+                pos = event.pos;
             }
 
-            if (pair.second.add) {
-                scope.push_scope(pair.second.scope);
+            if (event.add) {
+                scope.push_scope(event.atom);
             } else {
-                if (scope.back() == pair.second.scope) {
+                if (&scope.back() == event.atom) {
                     scope.pop_scope();
                 } else {
-                    std::vector<std::string> stack;
-                    while (!scope.empty() && scope.back() != pair.second.scope) {
+                    std::vector<scope::atom_t> stack;
+                    while (!scope.empty() && &scope.back() != event.atom) {
                         // D(DBF_Parser, bug("%s != %s\n", scope.back().c_str(),
-                        // pair.second.scope.c_str()););
-                        stack.emplace_back(scope.back());
+                        // event.atom->c_str()););
+                        stack.emplace_back(&scope.back());
                         scope.pop_scope();
                     }
                     if (!scope.empty()) {
@@ -83,29 +118,27 @@ struct scopes_t {
             // D(DBF_Parser, bug("→ %s\n", to_s(scope).c_str()););
         }
 
-        out.emplace(pos, scope);
+        out.emplace_back(pos, scope);
         return scope;
     }
 
     size_t tracking = 0;
-    std::vector<std::string> stack;
+    std::vector<scope::atom_t> stack;
 
 private:
-    struct record_t {
-        record_t(std::string const& scope, bool add)
-            : scope(scope)
-            , add(add)
-        {
-        }
-        std::string scope;
+    // events at the same position are ordered by rank
+    struct event_t {
+        size_t pos;
+        ssize_t rank;
+        scope::atom_t atom;
         bool add;
     };
-    std::multimap<size_t, record_t> map;
+    std::vector<event_t> events;
 };
 } // namespace
 
 namespace parse {
-size_t rule_t::rule_id_counter = 0;
+std::atomic<size_t> rule_t::rule_id_counter(0);
 
 bool equal(stack_ptr lhs, stack_ptr rhs)
 {
@@ -177,43 +210,151 @@ static std::string expand_back_references(std::string const& ptrn,
     return res;
 }
 
+// end and while patterns with back references, compiled once per expanded
+// string and shared by all documents. the least recently used are dropped
+class dynamic_patterns_t {
+public:
+    regexp::pattern_t get(std::string const& ptrn)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _index.find(ptrn);
+        if (it != _index.end()) {
+            _patterns.splice(_patterns.begin(), _patterns, it->second);
+            return it->second->second;
+        }
+
+        regexp::pattern_t res(ptrn);
+        res.analyse(nullptr);
+        _patterns.emplace_front(ptrn, res);
+        _index.emplace(ptrn, _patterns.begin());
+        if (_patterns.size() > kMaxDynamicPatterns) {
+            _index.erase(_patterns.back().first);
+            _patterns.pop_back();
+        }
+        return res;
+    }
+
+private:
+    typedef std::list<std::pair<std::string, regexp::pattern_t>> patterns_t;
+
+    std::mutex _mutex;
+    patterns_t _patterns; // most recently used first
+    std::unordered_map<std::string, patterns_t::iterator> _index;
+};
+
+static dynamic_patterns_t dynamic_patterns;
+
+// ===================
+// = Interned states =
+// ===================
+
+// one object per distinct state a line ends in. lines (of any document)
+// ending in the same state share it, and equal states are the same
+// pointer. interned states are never changed, the parser copies one before
+// moving its anchor. the table holds weak references, expired ones are
+// swept as it grows
+class stack_table_t {
+public:
+    stack_ptr intern(stack_ptr const& stack)
+    {
+        if (!stack || stack->interned)
+            return stack;
+
+        stack->parent = intern(stack->parent);
+        size_t hash = hash_of(*stack);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto range = _states.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            stack_ptr res = it->second.lock();
+            if (res && identical(*res, *stack))
+                return res;
+        }
+
+        if (_states.size() >= _sweep_at)
+            sweep();
+        stack->interned = true;
+        _states.emplace(hash, stack);
+        return stack;
+    }
+
+private:
+    static size_t const kSweepAt = 1024;
+
+    // parents are interned first, so they compare by pointer
+    static size_t hash_of(stack_t const& stack)
+    {
+        size_t res = std::hash<size_t>()(stack.rule->rule_id);
+        res = hash_combine(res, stack.scope.hash());
+        res = hash_combine(res, std::hash<stack_t const*>()(stack.parent.get()));
+        res = hash_combine(res, std::hash<std::string>()(to_s(stack.end_pattern)));
+        res = hash_combine(res, std::hash<std::string>()(to_s(stack.while_pattern)));
+        return hash_combine(res, stack.anchor);
+    }
+
+    // operator== and everything else a following line is parsed with
+    static bool identical(stack_t const& lhs, stack_t const& rhs)
+    {
+        return *lhs.rule == *rhs.rule && lhs.scope == rhs.scope
+            && lhs.parent == rhs.parent
+            && lhs.while_pattern == rhs.while_pattern
+            && lhs.end_pattern == rhs.end_pattern
+            && lhs.scope_string == rhs.scope_string
+            && lhs.content_scope_string == rhs.content_scope_string
+            && lhs.anchor == rhs.anchor
+            && lhs.zw_begin_match == rhs.zw_begin_match
+            && lhs.apply_end_last == rhs.apply_end_last;
+    }
+
+    void sweep()
+    {
+        for (auto it = _states.begin(); it != _states.end();) {
+            if (it->second.expired())
+                it = _states.erase(it);
+            else
+                ++it;
+        }
+        size_t live = _states.size();
+        _sweep_at = live * 2 > kSweepAt ? live * 2 : kSweepAt;
+    }
+
+    std::mutex _mutex;
+    std::unordered_multimap<size_t, std::weak_ptr<stack_t>> _states;
+    size_t _sweep_at = kSweepAt;
+};
+
+static stack_table_t stack_table;
+
+// a state about to change, copied first if it is interned
+static void thaw(stack_ptr& stack)
+{
+    if (stack->interned) {
+        stack = std::make_shared<stack_t>(*stack);
+        stack->interned = false;
+    }
+}
+
+static void set_anchor(stack_ptr& stack, size_t anchor)
+{
+    if (stack->anchor != anchor) {
+        thaw(stack);
+        stack->anchor = anchor;
+    }
+}
+
 bool stack_t::operator==(stack_t const& rhs) const
 {
     if (*rule != *rhs.rule || scope != rhs.scope)
         return false;
     if (while_pattern != rhs.while_pattern || end_pattern != rhs.end_pattern)
         return false;
-    if ((!parent && rhs.parent) || (parent && (!rhs.parent || *parent != *rhs.parent)))
+    if ((!parent && rhs.parent) || (parent && (!rhs.parent || (parent != rhs.parent && *parent != *rhs.parent))))
         return false;
     return true;
 }
 
 bool stack_t::operator!=(stack_t const& rhs) const { return !(*this == rhs); }
 
-struct ranked_match_t {
-    ranked_match_t(rule_t* rule, regexp::match_t const& match, size_t rank,
-        bool is_end_pattern = false)
-        : rule(rule)
-        , match(match)
-        , rank(rank)
-        , is_end_pattern(is_end_pattern)
-    {
-    }
-    rule_t* rule;
-    regexp::match_t match;
-    size_t rank;
-    bool is_end_pattern;
-
-    // WATCH_LEAKS(ranked_match_t);
-
-    bool operator<(ranked_match_t const& rhs) const
-    {
-        return match.begin() == rhs.match.begin()
-            ? rank < rhs.rank
-            : match.begin() < rhs.match.begin();
-    }
-};
-
 static std::string expand(std::string const& scopeString,
     regexp::match_t const& match)
 {
@@ -225,8 +366,8 @@ static std::string expand(std::string const& scopeString,
     // format_string::expand(scopeString, match.captures()) : scopeString;
 
     std::string res = scopeString;
-    std::map<std::string, std::string> captures = match.captures();
-    std::map<std::string, std::string>::iterator it = captures.begin();
+    std::map<std::string, std::string> const& captures = match.captures();
+    std::map<std::string, std::string>::const_iterator it = captures.begin();
     while (it != captures.end()) {
         std::string first = "$" + it->first;
         std::string second = it->second;
@@ -240,7 +381,61 @@ static std::string expand(std::string const& scopeString,
 }
 
 static stack_ptr parse(char const* first, char const* last, stack_ptr stack,
-    scopes_t& scopes, bool firstLine, size_t i);
+    scopes_t& scopes, bool firstLine, size_t i, size_t stop,
+    size_t* reached = nullptr, checkpoint_fn const* checkpoint = nullptr,
+    size_t step = 0);
+
+// the capture rules of a match, by position and longest first. buffers are
+// kept per thread and nesting depth, captures parse their own captures
+class capture_rules_t {
+public:
+    struct capture_t {
+        size_t from;
+        size_t to;
+        rule_t* rule;
+    };
+
+    capture_rules_t()
+        : rules(acquire())
+    {
+    }
+
+    ~capture_rules_t()
+    {
+        rules.clear();
+        _depth--;
+    }
+
+    void add(size_t from, size_t to, rule_t* rule)
+    {
+        rules.push_back(capture_t{ from, to, rule });
+
+        // a stable insertion sort, there are few captures
+        for (size_t j = rules.size() - 1; j > 0 && less(rules[j], rules[j - 1]); --j)
+            std::swap(rules[j], rules[j - 1]);
+    }
+
+    std::vector<capture_t>& rules;
+
+private:
+    static bool less(capture_t const& lhs, capture_t const& rhs)
+    {
+        return lhs.from < rhs.from || (lhs.from == rhs.from && lhs.to - lhs.from > rhs.to - rhs.from);
+    }
+
+    static std::vector<capture_t>& acquire()
+    {
+        if (_depth == _buffers.size())
+            _buffers.emplace_back(new std::vector<capture_t>());
+        return *_buffers[_depth++];
+    }
+
+    static thread_local std::vector<std::unique_ptr<std::vector<capture_t>>> _buffers;
+    static thread_local size_t _depth;
+};
+
+thread_local std::vector<std::unique_ptr<std::vector<capture_rules_t::capture_t>>> capture_rules_t::_buffers;
+thread_local size_t capture_rules_t::_depth = 0;
 
 static void apply_captures(scope::scope_t const& scope,
     regexp::match_t const& m,
@@ -250,18 +445,15 @@ static void apply_captures(scope::scope_t const& scope,
     if (!captures)
         return;
 
-    std::multimap<std::pair<size_t, ssize_t>, rule_ptr> rules;
+    capture_rules_t rules;
 
     repository_t::const_iterator ruleIter = captures->begin();
-    std::multimap<std::string, std::pair<size_t, size_t>>::const_iterator
-        indexIter
+    regexp::capture_indices_t::const_iterator indexIter
         = m.capture_indices().begin();
     while (ruleIter != captures->end() && indexIter != m.capture_indices().end()) {
         if (ruleIter->first == indexIter->first && indexIter->second.first != indexIter->second.second)
-            rules.emplace(
-                std::make_pair(indexIter->second.first,
-                    -(indexIter->second.second - indexIter->second.first)),
-                ruleIter->second);
+            rules.add(indexIter->second.first, indexIter->second.second,
+                ruleIter->second.get());
 
         if (ruleIter->first < indexIter->first)
             ++ruleIter;
@@ -269,11 +461,11 @@ static void apply_captures(scope::scope_t const& scope,
             ++indexIter;
     }
 
-    for (auto const& it : rules) {
-        size_t from = it.first.first;
-        size_t to = it.first.first - it.first.second;
+    for (auto const& it : rules.rules) {
+        size_t from = it.from;
+        size_t to = it.to;
 
-        rule_ptr const& rule = it.second;
+        rule_t* rule = it.rule;
         if (rule->scope_string != NULL_STR) {
             std::string const scopeString = expand(rule->scope_string, m);
             scopes.add(from, scopeString);
@@ -283,13 +475,13 @@ static void apply_captures(scope::scope_t const& scope,
         if (!rule->children.empty()) {
             // D(DBF_Parser, bug("re-parse: ‘%.*s’ (range %zu-%zu)\n", (int)(to -
             // from), m.buffer() + from, from, to););
-            auto stack = std::make_shared<parse::stack_t>(rule.get(), scope);
+            auto stack = std::make_shared<parse::stack_t>(rule, scope);
             stack->anchor = from;
 
-            std::vector<std::string> tmp;
+            std::vector<scope::atom_t> tmp;
             tmp.swap(scopes.stack);
             ++scopes.tracking;
-            parse(m.buffer(), m.buffer() + to, stack, scopes, firstLine, from);
+            parse(m.buffer(), m.buffer() + to, stack, scopes, firstLine, from, to);
             while (!scopes.stack.empty())
                 scopes.remove(to, scopes.stack.back(), true);
             --scopes.tracking;
@@ -298,56 +490,89 @@ static void apply_captures(scope::scope_t const& scope,
     }
 }
 
+// rules already collected for the current context. the marks are per thread
+// and stamped with a new generation for every set, so the grammar is never
+// written to while parsing and can be shared by parses on several threads
+class rule_set_t {
+public:
+    rule_set_t()
+    {
+        if (++_generation == 0) {
+            std::fill(_marks.begin(), _marks.end(), 0);
+            ++_generation;
+        }
+    }
+
+    bool count(rule_t const* rule) const
+    {
+        return rule->rule_id < _marks.size() && _marks[rule->rule_id] == _generation;
+    }
+
+    void insert(rule_t const* rule)
+    {
+        if (rule->rule_id >= _marks.size())
+            _marks.resize(std::max<size_t>(rule->rule_id + 1, rule_t::rule_id_counter + 1), 0);
+        _marks[rule->rule_id] = _generation;
+    }
+
+private:
+    static thread_local std::vector<uint32_t> _marks;
+    static thread_local uint32_t _generation;
+};
+
+thread_local std::vector<uint32_t> rule_set_t::_marks;
+thread_local uint32_t rule_set_t::_generation = 0;
+
 static void collect_children(std::vector<rule_ptr> const& children,
     std::vector<rule_t*>& res,
-    std::vector<rule_t*>* groups);
+    std::vector<rule_t*>* groups, rule_set_t& included);
 
 static void collect_rule(rule_t* rule, std::vector<rule_t*>& res,
-    std::vector<rule_t*>* groups)
+    std::vector<rule_t*>* groups, rule_set_t& included)
 {
-    while (rule && rule->include && !rule->included) {
+    while (rule && rule->include && !included.count(rule)) {
         if (groups) {
-            rule->included = true;
+            included.insert(rule);
             groups->push_back(rule);
         }
         rule = rule->include;
     }
 
-    if (!rule || rule->included)
+    if (!rule || included.count(rule))
         return;
 
     if (rule->match_pattern) {
-        rule->included = true;
+        included.insert(rule);
         res.push_back(rule);
     } else if (!rule->children.empty()) {
         if (groups) {
-            rule->included = true;
+            included.insert(rule);
             groups->push_back(rule);
         }
 
-        collect_children(rule->children, res, groups);
+        collect_children(rule->children, res, groups, included);
     }
 }
 
 static void collect_children(std::vector<rule_ptr> const& children,
     std::vector<rule_t*>& res,
-    std::vector<rule_t*>* groups)
+    std::vector<rule_t*>* groups, rule_set_t& included)
 {
     for (rule_ptr const& rule : children)
-        collect_rule(rule.get(), res, groups);
+        collect_rule(rule.get(), res, groups, included);
 }
 
 #if 1
 static void collect_injections(stack_ptr const& stack,
     scope::context_t const& scope,
     std::vector<rule_t*> const& groups,
-    std::vector<rule_t*>& res)
+    std::vector<rule_t*>& res, rule_set_t& included)
 {
     // D(DBF_Parser_Flow, bug("%s\n", to_s(scope).c_str()););
     for (stack_ptr node = stack; node; node = node->parent) {
         for (auto const& pair : node->rule->injections) {
             if (pair.first.does_match(scope))
-                collect_rule(pair.second.get(), res, nullptr);
+                collect_rule(pair.second.get(), res, nullptr, included);
         }
     }
 
@@ -358,78 +583,324 @@ static void collect_injections(stack_ptr const& stack,
         for (auto const& pair : rule->injections) {
             // D(DBF_Parser_Flow, bug("selector: ‘%s’ → %s\n", to_s(pair.first).c_str(), BSTR(pair.first.does_match(scope))););
             if (pair.first.does_match(scope))
-                collect_rule(pair.second.get(), res, nullptr);
+                collect_rule(pair.second.get(), res, nullptr, included);
         }
     }
 }
 #endif
 
-static size_t apply_rules(size_t rank, std::vector<rule_t*> const& rules,
-    char const* first, char const* last,
-    OnigOptionType options, size_t i,
-    std::set<ranked_match_t>& res,
-    std::map<size_t, regexp::match_t>& match_cache)
+// rules injected into a context, for a scope and the rules with injections
+// on the stack below it. the scope keeps the node it is found by alive
+struct injected_t {
+    scope::scope_t scope;
+    std::vector<rule_t const*> injectors;
+    std::vector<rule_t*> pre;
+    std::vector<rule_t*> post;
+};
+typedef std::shared_ptr<injected_t const> injected_ptr;
+
+// the flattened candidates of a context rule, built once. the included
+// groups are kept for matching injections, which are cached by scope
+struct candidates_t {
+    std::vector<rule_t*> rules;
+    std::vector<rule_t*> groups;
+    bool has_injections = false;
+
+    // by the scope's node and the rules with injections on the stack, see
+    // injectors_hash. cleared when it grows past kMaxInjectedScopes
+    std::mutex mutex;
+    std::unordered_map<size_t, injected_ptr> injected;
+};
+
+static candidates_ptr rule_candidates(rule_t* rule)
+{
+    candidates_ptr res = std::atomic_load(&rule->candidates);
+    if (res)
+        return res;
+
+    res = std::make_shared<candidates_t>();
+    rule_set_t included;
+    collect_children(rule->children, res->rules, &res->groups, included);
+    for (rule_t* group : res->groups) {
+        if (!group->is_root && !group->injections.empty())
+            res->has_injections = true;
+    }
+
+    // includes of the owning grammar are still being resolved
+    if (!rule->ready || *rule->ready)
+        std::atomic_store(&rule->candidates, res);
+    return res;
+}
+
+// a hash of the rules with injections on the stack, innermost first.
+// returns false if there are none
+static bool injectors_hash(stack_ptr const& stack, size_t& res)
 {
-    for (rule_t* rule : rules) {
-        rule->included = false;
-
-        auto it = match_cache.find(rule->rule_id);
-        if (it != match_cache.end()) {
-            if (it->second)
-                res.emplace(rule, it->second, ++rank);
-        } else {
-            auto match = regexp::search(rule->match_pattern, first, last, first + i,
-                last, options);
-            if (!rule->match_pattern_is_anchored)
-                match_cache.emplace(rule->rule_id, match);
-            if (match)
-                res.emplace(rule, match, ++rank);
+    bool found = false;
+    res = 0;
+    for (stack_t const* node = stack.get(); node; node = node->parent.get()) {
+        if (!node->rule->injections.empty()) {
+            res = hash_combine(res, std::hash<rule_t const*>()(node->rule));
+            found = true;
         }
     }
-    return rank;
+    return found;
 }
 
-static void collect_rules(char const* first, char const* last, size_t i,
-    bool firstLine, stack_ptr const& stack,
-    std::set<ranked_match_t>& res,
-    std::map<size_t, regexp::match_t>& match_cache)
+static bool same_injectors(stack_ptr const& stack,
+    std::vector<rule_t const*> const& injectors)
 {
-    std::vector<rule_t*> rules, groups, injectedRulesPre, injectedRulesPost;
-    collect_children(stack->rule->children, rules, &groups);
+    size_t i = 0;
+    for (stack_t const* node = stack.get(); node; node = node->parent.get()) {
+        if (!node->rule->injections.empty()) {
+            if (i == injectors.size() || injectors[i] != node->rule)
+                return false;
+            i++;
+        }
+    }
+    return i == injectors.size();
+}
 
+static injected_ptr rule_injections(stack_ptr const& stack,
+    candidates_t& candidates, size_t injectors)
+{
+    size_t key = hash_combine(std::hash<void const*>()(stack->scope.node_id()), injectors);
+    std::lock_guard<std::mutex> lock(candidates.mutex);
+    auto it = candidates.injected.find(key);
+    if (it != candidates.injected.end() && it->second->scope == stack->scope
+        && same_injectors(stack, it->second->injectors))
+        return it->second;
+
+    rule_set_t included;
+    for (rule_t* rule : candidates.rules)
+        included.insert(rule);
+    for (rule_t* rule : candidates.groups)
+        included.insert(rule);
+
+    std::shared_ptr<injected_t> res = std::make_shared<injected_t>();
+    res->scope = stack->scope;
+    for (stack_t const* node = stack.get(); node; node = node->parent.get()) {
+        if (!node->rule->injections.empty())
+            res->injectors.push_back(node->rule);
+    }
 #if 1
     collect_injections(stack,
-        scope::context_t(stack->scope, ""), groups, injectedRulesPre);
+        scope::context_t(stack->scope, ""), candidates.groups, res->pre, included);
     collect_injections(stack,
-        scope::context_t("", stack->scope), groups, injectedRulesPost);
+        scope::context_t("", stack->scope), candidates.groups, res->post, included);
 #endif
+    // entries are shared, scanners holding one keep it past a clear
+    if (candidates.injected.size() >= kMaxInjectedScopes)
+        candidates.injected.clear();
+    candidates.injected[key] = res;
+    return res;
+}
 
-    for (rule_t* rule : groups)
-        rule->included = false;
+// ===========
+// = Scanner =
+// ===========
 
-    // ============================
-    // = Match rules against text =
-    // ============================
+// a pattern searched from some position. the result stays valid for any
+// later position up to begin, unless the pattern is anchored with \G
+struct scan_t {
+    OnigRegion* region;
+    size_t begin;
+};
 
-    res.clear();
-    OnigOptionType const options = anchor_options(firstLine, stack->anchor == i, first, last);
+// searches the candidate patterns of the current context for the first
+// match at or after a position. results of unanchored rules are kept for
+// the whole line across contexts, and searched again only once the
+// position has moved past their begin
+class scanner_t {
+public:
+    struct slot_t {
+        rule_t* rule;
+        regexp::pattern_t const* pattern;
+        scan_t* scan;
+        bool is_end_pattern;
+        bool dropped;
+    };
 
-    size_t rank = apply_rules(0, injectedRulesPre, first, last, options, i, res,
-        match_cache);
-    size_t endPatternRank = ++rank;
-    rank = apply_rules(rank, rules, first, last, options, i, res, match_cache);
+    scanner_t(char const* first, char const* last, char const* range,
+        OnigOptionType options)
+        : first(first)
+        , last(last)
+        , range(range)
+        , options(options)
+        , storage(acquire_storage())
+    {
+    }
 
-    if (stack->end_pattern) {
-        // D(DBF_Parser, bug("end pattern: %s\n",
-        // to_s(stack->end_pattern).c_str()););
-        if (regexp::match_t const& match = regexp::search(
-                stack->end_pattern, first, last, first + i, last, options))
-            res.emplace(stack->rule, match,
-                stack->apply_end_last ? ++rank : endPatternRank, true);
+    ~scanner_t()
+    {
+        release_local();
+        storage.slots.clear();
+        _depth--;
     }
 
-    rank = apply_rules(rank, injectedRulesPost, first, last, options, i, res,
-        match_cache);
+    // the rules of a context, in the order they are preferred when matches
+    // begin at the same position
+    void reset(stack_ptr const& stack, size_t i);
+
+    // best match at or after i, null when nothing is left to match
+    slot_t* next(size_t i)
+    {
+        slot_t* res = nullptr;
+        for (slot_t& slot : storage.slots) {
+            if (slot.dropped)
+                continue;
+            if (slot.scan->begin < i)
+                search(slot, i);
+            if (slot.scan->begin == SIZE_T_MAX)
+                continue;
+            if (!res || slot.scan->begin < res->scan->begin)
+                res = &slot;
+        }
+        return res;
+    }
+
+    void search(slot_t& slot, size_t i)
+    {
+        if (!regexp::search(*slot.pattern, first, last, first + i, range, options,
+                slot.scan->region))
+            slot.scan->begin = SIZE_T_MAX;
+        else
+            slot.scan->begin = slot.scan->region->beg[0];
+    }
+
+    // a zero length match is not applied again in this context
+    void drop(slot_t& slot) { slot.dropped = true; }
+
+    regexp::match_t match(slot_t const& slot) const
+    {
+        return regexp::copy_match(*slot.pattern, first, slot.scan->region);
+    }
+
+private:
+    // the scans of the line, by rule id, valid for the current generation
+    struct line_scan_t {
+        scan_t scan;
+        uint32_t generation;
+    };
+
+    // what a scanner needs for a line. kept per thread and reused by the
+    // next scanner at the same depth, captures are parsed by nested ones
+    struct storage_t {
+        storage_t()
+            : generation(0)
+        {
+        }
+
+        ~storage_t()
+        {
+            for (line_scan_t& it : line) {
+                if (it.scan.region)
+                    onig_region_free(it.scan.region, 1);
+            }
+        }
+
+        std::vector<slot_t> slots;
+        std::vector<scan_t> local; // end and anchored patterns of this context
+        std::vector<line_scan_t> line;
+        uint32_t generation;
+    };
+
+    static storage_t& acquire_storage()
+    {
+        if (_depth == _storage.size())
+            _storage.emplace_back(new storage_t());
+        storage_t& res = *_storage[_depth++];
+
+        if (++res.generation == 0) {
+            for (line_scan_t& it : res.line)
+                it.generation = 0;
+            ++res.generation;
+        }
+        // rules made while parsing, by grammars still loading, are not kept
+        if (res.line.size() <= rule_t::rule_id_counter)
+            res.line.resize(rule_t::rule_id_counter + 1, line_scan_t{ scan_t{ nullptr, SIZE_T_MAX }, 0 });
+        return res;
+    }
+
+    void add(rule_t* rule, regexp::pattern_t const* pattern, size_t i,
+        bool is_end_pattern);
+
+    void release_local()
+    {
+        for (scan_t& scan : storage.local)
+            regexp::release_region(scan.region);
+        storage.local.clear();
+    }
+
+    char const* first;
+    char const* last;
+    char const* range;
+    OnigOptionType options;
+    storage_t& storage;
+
+    static thread_local std::vector<std::unique_ptr<storage_t>> _storage;
+    static thread_local size_t _depth;
+};
+
+thread_local std::vector<std::unique_ptr<scanner_t::storage_t>> scanner_t::_storage;
+thread_local size_t scanner_t::_depth = 0;
+
+void scanner_t::add(rule_t* rule, regexp::pattern_t const* pattern, size_t i,
+    bool is_end_pattern)
+{
+    slot_t slot = { rule, pattern, nullptr, is_end_pattern, false };
+    if (is_end_pattern || rule->match_pattern_is_anchored || rule->rule_id >= storage.line.size()) {
+        storage.local.push_back(scan_t{ regexp::acquire_region(), SIZE_T_MAX });
+        slot.scan = &storage.local.back();
+        search(slot, i);
+    } else {
+        line_scan_t& it = storage.line[rule->rule_id];
+        slot.scan = &it.scan;
+        if (it.generation != storage.generation) {
+            it.generation = storage.generation;
+            if (!it.scan.region)
+                it.scan.region = onig_region_new();
+            search(slot, i);
+        }
+    }
+    storage.slots.push_back(slot);
+}
+
+void scanner_t::reset(stack_ptr const& stack, size_t i)
+{
+    candidates_ptr candidates = rule_candidates(stack->rule);
+    std::vector<rule_t*> const& rules = candidates->rules;
+
+    size_t injectors;
+    bool has_injectors = injectors_hash(stack, injectors);
+
+    static std::vector<rule_t*> const none;
+    injected_ptr injected;
+    if (candidates->has_injections || has_injectors)
+        injected = rule_injections(stack, *candidates, injectors);
+    std::vector<rule_t*> const& injectedRulesPre = injected ? injected->pre : none;
+    std::vector<rule_t*> const& injectedRulesPost = injected ? injected->post : none;
+
+    // ============================
+    // = Match rules against text =
+    // ============================
+
+    release_local();
+    storage.slots.clear();
+
+    // slots point into local, it must not grow while they are added
+    storage.local.reserve(injectedRulesPre.size() + rules.size() + injectedRulesPost.size() + 1);
+
+    for (rule_t* rule : injectedRulesPre)
+        add(rule, &rule->match_pattern, i, false);
+    if (stack->end_pattern && !stack->apply_end_last)
+        add(stack->rule, &stack->end_pattern, i, true);
+    for (rule_t* rule : rules)
+        add(rule, &rule->match_pattern, i, false);
+    if (stack->end_pattern && stack->apply_end_last)
+        add(stack->rule, &stack->end_pattern, i, true);
+    for (rule_t* rule : injectedRulesPost)
+        add(rule, &rule->match_pattern, i, false);
 }
 
 static bool has_cycle(size_t rule_id, size_t i, stack_ptr const& stack)
@@ -441,17 +912,27 @@ static bool has_cycle(size_t rule_id, size_t i, stack_ptr const& stack)
     return stack->parent ? has_cycle(rule_id, i, stack->parent) : false;
 }
 
+// parse up to the first match that begins past stop. matches are searched
+// for only where they begin at most as far again past stop, onig's range
+// bounds where a match may begin, the match itself may run on to last.
+// when resuming a partially parsed line (reached is set) the while
+// patterns have already been applied. checkpoint is given the states where
+// the rules are collected again, step bytes apart, and may stop the parse
 static stack_ptr parse(char const* first, char const* last, stack_ptr stack,
-    scopes_t& scopes, bool firstLine, size_t i)
+    scopes_t& scopes, bool firstLine, size_t i, size_t stop, size_t* reached,
+    checkpoint_fn const* checkpoint, size_t step)
 {
     // D(DBF_Parser_Flow, bug("%.*s", (int)(last - first), first););
 
+    char const* range = stop + (stop - i) < (size_t)(last - first) ? first + stop + (stop - i) : last;
+    bool resume = reached && i > 0;
+
     // ==============================
     // = apply the ‘while’ patterns =
     // ==============================
 
     std::vector<stack_ptr> while_rules;
-    for (stack_ptr node = stack; node->while_pattern; node = node->parent) {
+    for (stack_ptr node = stack; !resume && node->while_pattern; node = node->parent) {
         while_rules.push_back(node);
         if (node->scope_string != NULL_STR)
             scopes.remove(i, node->scope_string, true);
@@ -485,14 +966,15 @@ static stack_ptr parse(char const* first, char const* last, stack_ptr stack,
                 scopes.add(m.end(), scopeString);
             }
 
-            stack->anchor = i = m.end();
+            i = m.end();
+            set_anchor(stack, i);
             it++;
             continue;
         }
 
         stack = (*it)->parent;
         if (stack->while_pattern)
-            stack->anchor = i;
+            set_anchor(stack, i);
         break;
 
         it++;
@@ -502,13 +984,15 @@ static stack_ptr parse(char const* first, char const* last, stack_ptr stack,
     // = Parse rest of line =
     // ======================
 
-    std::set<ranked_match_t> rules;
-    std::map<size_t, regexp::match_t> match_cache;
-    collect_rules(first, last, i, firstLine, stack, rules, match_cache);
+    scanner_t scanner(first, last, range,
+        anchor_options(firstLine, false, first, last));
+    scanner.reset(stack, i);
+    size_t next_checkpoint = i + step;
+    bool checkpoint_stop = false;
 
     // D(DBF_Parser, bug("%zu rules (out of %zu), parse: %.*s", rules.size(),
     // stack->rule->children.size(), (int)(last - first - i), first + i););
-    while (!rules.empty()) {
+    while (scanner_t::slot_t* slot = scanner.next(i)) {
         // DB(
         // D(DBF_Parser, bug("offset: %zu\n", i););
         // for(auto const& it : rules)
@@ -516,31 +1000,25 @@ static stack_ptr parse(char const* first, char const* last, stack_ptr stack,
         //   to_s(it.rule->match_pattern).c_str());
         // )
 
-        ranked_match_t m = *rules.begin();
-        rules.erase(rules.begin());
+        if (slot->scan->begin > stop)
+            break;
 
-        if (m.match.begin() < i) {
-            regexp::pattern_t const& ptrn = m.is_end_pattern ? stack->end_pattern : m.rule->match_pattern;
-            if (m.match = regexp::search(
-                    ptrn, first, last, first + i, last,
-                    anchor_options(firstLine, stack->anchor == i, first, last)))
-                rules.insert(m);
-            continue;
-        }
+        regexp::match_t const match = scanner.match(*slot);
 
-        i = m.match.end();
-        // D(DBF_Parser_Flow, bug("match %2zu-%2zu: %s\n", m.match.begin(),
-        // m.match.end(), m.rule->scope_string != NULL_STR ?
-        // m.rule->scope_string.c_str() : "(untitled)"););
+        i = match.end();
+        bool stopped = i > stop;
+        // D(DBF_Parser_Flow, bug("match %2zu-%2zu: %s\n", match.begin(),
+        // match.end(), slot->rule->scope_string != NULL_STR ?
+        // slot->rule->scope_string.c_str() : "(untitled)"););
 
-        rule_t* rule = m.rule;
-        if (m.is_end_pattern) {
+        rule_t* rule = slot->rule;
+        if (slot->is_end_pattern) {
             if (stack->content_scope_string != NULL_STR)
-                scopes.remove(m.match.begin(), stack->content_scope_string, true);
-            apply_captures(scope, m.match, rule->end_captures ? rule->end_captures : rule->captures,
+                scopes.remove(match.begin(), stack->content_scope_string, true);
+            apply_captures(scope, match, rule->end_captures ? rule->end_captures : rule->captures,
                 scopes, firstLine);
             if (stack->scope_string != NULL_STR)
-                scopes.remove(m.match.end(), stack->scope_string, true);
+                scopes.remove(match.end(), stack->scope_string, true);
 
             bool nothingMatched = stack->zw_begin_match && stack->anchor == i;
 
@@ -557,34 +1035,36 @@ static stack_ptr parse(char const* first, char const* last, stack_ptr stack,
                 // %.*s", rule->scope_string != NULL_STR ? rule->scope_string.c_str() :
                 // "(untitled)", rule->match_string.c_str(), rule->end_string.c_str(),
                 // i, (int)(last - first), first);
+                stop = last - first;
                 break;
             }
         } else if (rule->while_string != NULL_STR || rule->end_string != NULL_STR) // begin-part of rule
         {
-            if (m.match.empty() && has_cycle(rule->rule_id, i, stack)) {
+            if (match.empty() && has_cycle(rule->rule_id, i, stack)) {
                 // os_log_error(OS_LOG_DEFAULT, "No bytes matched and recursive include
                 // of rule ‘%{public}s’, begin = ‘%{public}s’, end = ‘%{public}s’,
                 // position %zu for line: %.*s", rule->scope_string != NULL_STR ?
                 // rule->scope_string.c_str() : "(untitled)",
                 // rule->match_string.c_str(), rule->end_string.c_str(), i, (int)(last -
                 // first), first);
+                stop = last - first;
                 break;
             }
             stack = std::make_shared<stack_t>(rule, scope::scope_t(), stack);
 
             if (rule->scope_string != NULL_STR) {
-                stack->scope_string = expand(rule->scope_string, m.match);
+                stack->scope_string = expand(rule->scope_string, match);
                 scope.push_scope(stack->scope_string);
-                scopes.add(m.match.begin(), stack->scope_string);
+                scopes.add(match.begin(), stack->scope_string);
             }
 
-            apply_captures(scope, m.match, rule->begin_captures ? rule->begin_captures : rule->captures,
+            apply_captures(scope, match, rule->begin_captures ? rule->begin_captures : rule->captures,
                 scopes, firstLine);
 
             if (rule->content_scope_string != NULL_STR) {
-                stack->content_scope_string = expand(rule->content_scope_string, m.match);
+                stack->content_scope_string = expand(rule->content_scope_string, match);
                 scope.push_scope(stack->content_scope_string);
-                scopes.add(m.match.end(), stack->content_scope_string);
+                scopes.add(match.end(), stack->content_scope_string);
             }
 
             stack->scope = scope;
@@ -592,49 +1072,67 @@ static stack_ptr parse(char const* first, char const* last, stack_ptr stack,
             stack->end_pattern = rule->end_pattern;
             stack->apply_end_last = rule->apply_end_last == "1";
             stack->anchor = i;
-            stack->zw_begin_match = m.match.empty();
-            stack->parent->anchor = SIZE_T_MAX;
+            stack->zw_begin_match = match.empty();
+            set_anchor(stack->parent, SIZE_T_MAX);
 
             if (!rule->while_pattern && rule->while_string != NULL_STR)
-                stack->while_pattern = expand_back_references(rule->while_string, m.match);
+                stack->while_pattern = dynamic_patterns.get(expand_back_references(rule->while_string, match));
             if (!rule->end_pattern && rule->end_string != NULL_STR)
-                stack->end_pattern = expand_back_references(rule->end_string, m.match);
+                stack->end_pattern = dynamic_patterns.get(expand_back_references(rule->end_string, match));
 
             // D(DBF_Parser_Flow, bug("descending, new scope %s\n",
             // to_s(scope).c_str()););
         } else // regular match-rule
         {
-            if (m.match.empty()) {
+            if (match.empty()) {
                 // os_log_error(OS_LOG_DEFAULT, "No bytes parsed by rule ‘%{public}s’,
                 // match = ‘%{public}s’, position %zu for line: %.*s",
                 // rule->scope_string != NULL_STR ? rule->scope_string.c_str() :
                 // "(untitled)", rule->match_string.c_str(), i, (int)(last - first),
                 // first);
+                scanner.drop(*slot);
                 continue; // do not re-apply since this matched zero characters
             }
 
             if (rule->scope_string != NULL_STR) {
-                std::string const scopeString = expand(rule->scope_string, m.match);
-                scopes.add(m.match.begin(), scopeString);
-                scopes.remove(m.match.end(), scopeString);
+                std::string const scopeString = expand(rule->scope_string, match);
+                scopes.add(match.begin(), scopeString);
+                scopes.remove(match.end(), scopeString);
             }
 
-            apply_captures(scope, m.match, rule->captures, scopes, firstLine);
-            if (m.match = regexp::search(
-                    m.rule->match_pattern, first, last, first + i, last,
-                    anchor_options(firstLine, stack->anchor == i, first, last)))
-                rules.insert(m);
+            apply_captures(scope, match, rule->captures, scopes, firstLine);
+            if (stopped)
+                break;
+            scanner.search(*slot, i);
 
             continue; // no context change, so skip finding rules for this context
         }
 
+        if (stopped)
+            break;
+
+        // a parse resumed here, in this state, goes on as this one does
+        if (checkpoint && i >= next_checkpoint && first + i < last) {
+            stack = stack_table.intern(stack);
+            if ((*checkpoint)(i, stack)) {
+                checkpoint_stop = true;
+                break;
+            }
+            next_checkpoint = i + step;
+        }
+
         // D(DBF_Parser, bug("%zu rules before collecting\n", rules.size()););
-        collect_rules(first, last, i, firstLine, stack, rules, match_cache);
+        scanner.reset(stack, i);
         // D(DBF_Parser, bug("%zu rules after collecting\n", rules.size()););
     }
 
     // D(DBF_Parser_Flow, bug("line done (%zu rules)\n", rules.size()););
-    stack->anchor = first + stack->anchor == last ? 0 : SIZE_T_MAX;
+    if (reached) {
+        *reached = i > stop || checkpoint_stop ? i : stop;
+        if (first + *reached < last)
+            return stack;
+    }
+    set_anchor(stack, first + stack->anchor == last ? 0 : SIZE_T_MAX);
     return stack;
 }
 
@@ -649,14 +1147,84 @@ static const char* utf8_find_safe_end(char const* first, char const* last)
     return last;
 }
 
+// events of the line being parsed, per thread
+static thread_local scopes_t line_scopes;
+
+// the state a line ends in, interned
+static stack_ptr finish(stack_ptr stack, scope::scope_t const& scope)
+{
+    if (stack->scope != scope) {
+        thaw(stack);
+        stack->scope = scope;
+    }
+    return stack_table.intern(stack);
+}
+
 stack_ptr parse(char const* first, char const* last, stack_ptr stack,
-    std::map<size_t, scope::scope_t>& map, bool firstLine)
+    scope_runs_t& runs, bool firstLine)
 {
-    scopes_t scopes;
+    regexp::match_arena_t arena;
+    scopes_t& scopes = line_scopes;
+    scopes.clear();
+    runs.clear();
     if (last - first > kParserMaxLineSize)
         last = utf8_find_safe_end(first, first + kParserMaxLineSize);
-    auto res = parse(first, last, stack, scopes, firstLine, 0);
-    res->scope = scopes.update(stack->scope, map);
+    auto res = parse(first, last, stack, scopes, firstLine, 0, last - first);
+    return finish(res, scopes.update(stack->scope, runs));
+}
+
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    scope_runs_t& runs, bool firstLine, size_t& offset, size_t stop)
+{
+    regexp::match_arena_t arena;
+    scopes_t& scopes = line_scopes;
+    scopes.clear();
+    runs.clear();
+    if (stop > (size_t)(last - first))
+        stop = last - first;
+    size_t from = offset;
+    auto res = parse(first, last, stack, scopes, firstLine, from, stop, &offset);
+    return finish(res, scopes.update(stack->scope, runs, from));
+}
+
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    scope_runs_t& runs, bool firstLine, size_t& offset, size_t step,
+    checkpoint_fn const& checkpoint)
+{
+    regexp::match_arena_t arena;
+    scopes_t& scopes = line_scopes;
+    scopes.clear();
+    runs.clear();
+    if ((size_t)(last - first) > kParserMaxLineSize)
+        last = utf8_find_safe_end(first, first + kParserMaxLineSize);
+    size_t from = offset;
+    auto res = parse(first, last, stack, scopes, firstLine, from, last - first, &offset, &checkpoint, step);
+    return finish(res, scopes.update(stack->scope, runs, from));
+}
+
+static thread_local scope_runs_t map_runs;
+
+static void copy_runs(scope_runs_t const& runs,
+    std::map<size_t, scope::scope_t>& map)
+{
+    for (auto const& run : runs)
+        map.emplace(run.first, run.second);
+}
+
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    std::map<size_t, scope::scope_t>& map, bool firstLine)
+{
+    auto res = parse(first, last, stack, map_runs, firstLine);
+    copy_runs(map_runs, map);
+    return res;
+}
+
+stack_ptr parse(char const* first, char const* last, stack_ptr stack,
+    std::map<size_t, scope::scope_t>& map, bool firstLine, size_t& offset,
+    size_t stop)
+{
+    auto res = parse(first, last, stack, map_runs, firstLine, offset, stop);
+    copy_runs(map_runs, map);
     return res;
 }
 } // namespace parse
@@ -1,6 +1,9 @@
 #include "pattern.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <cstdlib>
 
 struct udata_t {
     OnigUChar const* buffer;
@@ -63,31 +66,164 @@ std::string escape(std::string ptrn)
     return ptrn;
 }
 
-// =============
-// = pattern_t =
-// =============
+// ===================
+// = Shared patterns =
+// ===================
 
-void pattern_t::init(std::string const& pattern, OnigOptionType options)
+static regex_ptr compile_regex(std::string const& pattern, OnigOptionType options)
 {
     OnigRegex tmp = nullptr;
 
     OnigErrorInfo einfo;
-    if ((options & ONIG_OPTION_DONT_CAPTURE_GROUP) == 0)
-        options |= ONIG_OPTION_CAPTURE_GROUP;
     int r = onig_new(&tmp, (OnigUChar const*)pattern.data(),
         (OnigUChar const*)pattern.data() + pattern.size(), options,
         ONIG_ENCODING_UTF8, ONIG_SYNTAX_DEFAULT, &einfo);
     if (r == ONIG_NORMAL) {
-        compiled_pattern.reset(tmp, onig_free);
-    } else {
-        OnigUChar s[ONIG_MAX_ERROR_MESSAGE_LEN];
-        onig_error_code_to_str(s, r, &einfo);
-        // os_log_error(OS_LOG_DEFAULT, "pattern_t: %{public}s (%{public}s)", s,
-        // pattern.c_str());
+        return regex_ptr(tmp, onig_free);
+    }
+
+    OnigUChar s[ONIG_MAX_ERROR_MESSAGE_LEN];
+    onig_error_code_to_str(s, r, &einfo);
+    // os_log_error(OS_LOG_DEFAULT, "pattern_t: %{public}s (%{public}s)", s,
+    // pattern.c_str());
+
+    if (tmp)
+        onig_free(tmp);
+    return regex_ptr();
+}
+
+// about what a compiled regex holds, onig_memsize is only built for ruby
+static size_t regex_bytes(regex_t const* reg)
+{
+    size_t res = 0;
+    for (; reg; reg = reg->chain) {
+        res += sizeof(regex_t) + reg->alloc + (reg->exact_end - reg->exact)
+            + reg->repeat_range_alloc * sizeof(OnigRepeatRange);
+    }
+    return res;
+}
+
+namespace {
+struct registry_entry_t {
+    std::weak_ptr<regex_t> regex;
+    size_t bytes;
+    double seconds;
+};
+
+// entries expire with the last pattern using them, and are dropped when
+// the registry has doubled since expired entries were last dropped
+struct registry_t {
+    registry_t()
+        : purge_size(1024)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    std::mutex mutex;
+    std::map<std::pair<std::string, OnigOptionType>, registry_entry_t> entries;
+    size_t purge_size;
+    pattern_registry_stats_t stats;
+
+    void purge()
+    {
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->second.regex.expired())
+                it = entries.erase(it);
+            else
+                ++it;
+        }
+        purge_size = std::max<size_t>(1024, entries.size() * 2);
+    }
+};
+
+registry_t& registry()
+{
+    static registry_t res;
+    return res;
+}
+} // namespace
+
+static std::atomic<bool> pattern_registry_enabled(true);
 
-        if (tmp)
-            onig_free(tmp);
+void set_pattern_registry_enabled(bool enabled) { pattern_registry_enabled = enabled; }
+
+pattern_registry_stats_t pattern_registry_stats()
+{
+    registry_t& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    return reg.stats;
+}
+
+// compiled outside the lock, if another thread compiled the same pattern
+// meanwhile its regex is used instead
+static regex_ptr shared_regex(std::string const& pattern, OnigOptionType options)
+{
+    registry_t& reg = registry();
+    std::pair<std::string, OnigOptionType> key(pattern, options);
+    bool enabled = pattern_registry_enabled;
+    if (enabled) {
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        auto it = reg.entries.find(key);
+        if (it != reg.entries.end()) {
+            if (regex_ptr res = it->second.regex.lock()) {
+                reg.stats.shared++;
+                reg.stats.bytes_saved += it->second.bytes;
+                reg.stats.seconds_saved += it->second.seconds;
+                return res;
+            }
+        }
     }
+
+    auto start = std::chrono::steady_clock::now();
+    regex_ptr res = compile_regex(pattern, options);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!res) {
+        return res;
+    }
+
+    size_t bytes = regex_bytes(res.get());
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.stats.compiled++;
+    reg.stats.bytes_compiled += bytes;
+    reg.stats.seconds_compiled += seconds;
+    if (!enabled) {
+        return res;
+    }
+
+    registry_entry_t& entry = reg.entries[key];
+    if (regex_ptr existing = entry.regex.lock()) {
+        return existing;
+    }
+    entry.regex = res;
+    entry.bytes = bytes;
+    entry.seconds = seconds;
+    if (reg.entries.size() >= reg.purge_size) {
+        reg.purge();
+    }
+    return res;
+}
+
+// =============
+// = pattern_t =
+// =============
+
+static std::atomic<bool> deferred_patterns_enabled(true);
+static std::atomic<size_t> patterns_deferred(0);
+static std::atomic<size_t> patterns_compiled(0);
+
+void set_deferred_patterns_enabled(bool enabled) { deferred_patterns_enabled = enabled; }
+
+pattern_compile_stats_t pattern_compile_stats()
+{
+    pattern_compile_stats_t res = { patterns_deferred, patterns_compiled };
+    return res;
+}
+
+void pattern_t::init(std::string const& pattern, OnigOptionType options)
+{
+    if ((options & ONIG_OPTION_DONT_CAPTURE_GROUP) == 0)
+        options |= ONIG_OPTION_CAPTURE_GROUP;
+    compiled_pattern = shared_regex(pattern, options);
 }
 
 pattern_t::pattern_t(char const* pattern, OnigOptionType options)
@@ -126,6 +262,588 @@ pattern_t::pattern_t(std::string const& pattern, std::string const& str_options)
     init(pattern, options);
 }
 
+pattern_t::pattern_t(std::string const& pattern, OnigOptionType options, bool defer)
+    : pattern_string(pattern)
+{
+    if (!defer || !deferred_patterns_enabled) {
+        init(pattern, options);
+        return;
+    }
+    deferred = std::make_shared<deferred_pattern_t>();
+    deferred->options = options;
+    patterns_deferred++;
+}
+
+regex_ptr pattern_t::compile() const
+{
+    deferred_pattern_t* d = deferred.get();
+    if (!d->compiled.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        if (!d->compiled) {
+            pattern_t compiled(pattern_string, d->options);
+            d->compiled_pattern = compiled.compiled_pattern;
+            d->compiled.store(true, std::memory_order_release);
+            patterns_compiled++;
+        }
+    }
+    return d->compiled_pattern;
+}
+
+// ==============
+// = Prefilters =
+// ==============
+
+namespace {
+typedef std::bitset<256> byteset_t;
+
+// finds the bytes a match of a pattern can begin with. anything not
+// understood fails the analysis, so the pattern is always searched
+struct first_bytes_t {
+    first_bytes_t(std::string const& ptrn)
+        : it(ptrn.data())
+        , last(ptrn.data() + ptrn.size())
+        , failed(false)
+    {
+    }
+
+    char const* it;
+    char const* last;
+    bool failed;
+
+    bool at(char ch) const { return it != last && *it == ch; }
+
+    static byteset_t range(int from, int to)
+    {
+        byteset_t res;
+        for (int ch = from; ch <= to; ch++)
+            res.set(ch);
+        return res;
+    }
+
+    // utf-8 sequences are matched by their lead byte, any is allowed
+    static byteset_t non_ascii() { return range(0x80, 0xff); }
+
+    static byteset_t word()
+    {
+        return range('a', 'z') | range('A', 'Z') | range('0', '9') | range('_', '_') | non_ascii();
+    }
+
+    static byteset_t space()
+    {
+        return range('\t', '\r') | range(' ', ' ') | non_ascii();
+    }
+
+    static byteset_t xdigit()
+    {
+        return range('0', '9') | range('a', 'f') | range('A', 'F');
+    }
+
+    void skip_utf8()
+    {
+        while (it != last && (*it & 0xc0) == 0x80)
+            ++it;
+    }
+
+    // a code point given as \xHH, \x{H..} or \uHHHH
+    byteset_t code_point(bool braces_only)
+    {
+        unsigned value = 0;
+        bool braces = at('{');
+        if (braces)
+            ++it;
+        int digits = 0;
+        while (it != last && isxdigit(*it) && (braces || digits < (braces_only ? 4 : 2))) {
+            value = value * 16 + (isdigit(*it) ? *it - '0' : (tolower(*it) - 'a' + 10));
+            ++it;
+            ++digits;
+        }
+        if (braces) {
+            if (!at('}')) {
+                failed = true;
+                return byteset_t();
+            }
+            ++it;
+        }
+        if (digits == 0) {
+            failed = true;
+            return byteset_t();
+        }
+        return value < 0x80 ? range(value, value) : non_ascii();
+    }
+
+    // the escape after a backslash, in or out of a character class
+    byteset_t escape(bool in_class, bool& zero_width)
+    {
+        zero_width = false;
+        if (it == last) {
+            failed = true;
+            return byteset_t();
+        }
+        char ch = *it++;
+        switch (ch) {
+        case 'b':
+            if (in_class)
+                return range('\b', '\b');
+            // fall through
+        case 'B':
+        case 'A':
+        case 'z':
+        case 'Z':
+        case 'G':
+            zero_width = !in_class;
+            if (in_class)
+                failed = true;
+            return byteset_t();
+        case 'd':
+            return range('0', '9') | non_ascii();
+        case 'w':
+            return word();
+        case 's':
+            return space();
+        case 'h':
+            return xdigit();
+        case 'n':
+            return range('\n', '\n');
+        case 't':
+            return range('\t', '\t');
+        case 'r':
+            return range('\r', '\r');
+        case 'f':
+            return range('\f', '\f');
+        case 'v':
+            return range('\v', '\v');
+        case 'e':
+            return range(0x1b, 0x1b);
+        case 'a':
+            return range(0x07, 0x07);
+        case 'x':
+            return code_point(false);
+        case 'u':
+            return code_point(true);
+        }
+        if (isalnum(ch) || (ch & 0x80)) {
+            // back references, properties, negated classes and the like
+            failed = true;
+            return byteset_t();
+        }
+        return range((unsigned char)ch, (unsigned char)ch);
+    }
+
+    byteset_t posix_class()
+    {
+        static struct {
+            char const* name;
+            byteset_t (*set)();
+        } const classes[] = {
+            { "alpha:]", [] { return range('a', 'z') | range('A', 'Z') | non_ascii(); } },
+            { "alnum:]", [] { return range('a', 'z') | range('A', 'Z') | range('0', '9') | non_ascii(); } },
+            { "digit:]", [] { return range('0', '9') | non_ascii(); } },
+            { "upper:]", [] { return range('A', 'Z') | non_ascii(); } },
+            { "lower:]", [] { return range('a', 'z') | non_ascii(); } },
+            { "space:]", &first_bytes_t::space },
+            { "word:]", &first_bytes_t::word },
+            { "xdigit:]", &first_bytes_t::xdigit },
+        };
+        for (auto const& it : classes) {
+            size_t len = strlen(it.name);
+            if ((size_t)(last - this->it) >= len && strncmp(this->it, it.name, len) == 0) {
+                this->it += len;
+                return it.set();
+            }
+        }
+        failed = true;
+        return byteset_t();
+    }
+
+    static int single(byteset_t const& set)
+    {
+        if (set.count() != 1)
+            return -1;
+        for (int ch = 0; ch < 256; ch++) {
+            if (set.test(ch))
+                return ch;
+        }
+        return -1;
+    }
+
+    // a [...] class, the opening bracket is consumed
+    byteset_t char_class()
+    {
+        bool negate = at('^');
+        if (negate)
+            ++it;
+
+        byteset_t res;
+        bool first = true;
+        while (!failed && it != last && (first || *it != ']')) {
+            first = false;
+            int from = -1;
+            byteset_t item;
+            bool zero_width;
+            if (at('[')) {
+                ++it;
+                if (!at(':')) {
+                    failed = true; // nested classes
+                    break;
+                }
+                ++it;
+                item = posix_class();
+            } else if (at('&') && it + 1 != last && it[1] == '&') {
+                failed = true; // intersections
+                break;
+            } else if (at('\\')) {
+                ++it;
+                item = escape(true, zero_width);
+                from = single(item);
+            } else {
+                from = (unsigned char)*it++;
+                if (from & 0x80) {
+                    skip_utf8();
+                    item = non_ascii();
+                    from = -1;
+                } else {
+                    item = range(from, from);
+                }
+            }
+
+            // a-z, ranges past ascii allow any lead byte
+            if (from != -1 && at('-') && it + 1 != last && it[1] != ']') {
+                ++it;
+                int to = (unsigned char)*it++;
+                if (to == '\\') {
+                    to = single(escape(true, zero_width));
+                    if (to == -1) {
+                        failed = true;
+                        break;
+                    }
+                }
+                if (to & 0x80) {
+                    skip_utf8();
+                    item = range(from, 0x7f) | non_ascii();
+                } else if (to >= from) {
+                    item = range(from, to);
+                }
+            }
+            res |= item;
+        }
+
+        if (!at(']')) {
+            failed = true;
+            return byteset_t();
+        }
+        ++it;
+
+        if (negate)
+            res = ~res | non_ascii();
+        return res;
+    }
+
+    // {n}, {n,}, {,m} or {n,m}, false if the brace is a literal
+    bool interval(bool& nullable)
+    {
+        char const* p = it + 1;
+        char const* digits = p;
+        while (p != last && isdigit(*p))
+            ++p;
+        bool min_zero = p == digits || strtol(digits, nullptr, 10) == 0;
+        bool comma = p != last && *p == ',';
+        if (comma) {
+            ++p;
+            while (p != last && isdigit(*p))
+                ++p;
+        }
+        if (p == last || *p != '}' || (p == digits && !comma))
+            return false;
+        it = p + 1;
+        nullable = min_zero;
+        return true;
+    }
+
+    // a single item of a sequence with its quantifiers. zero width items
+    // and quantified ones may match nothing
+    byteset_t item(bool& nullable)
+    {
+        byteset_t res;
+        nullable = false;
+
+        char ch = *it;
+        if (ch == '(') {
+            ++it;
+            bool zero_width = false;
+            if (at('?')) {
+                ++it;
+                if (at(':') || at('>')) {
+                    ++it;
+                } else if (at('=') || at('!')) {
+                    ++it;
+                    zero_width = true;
+                } else if (at('<') && it + 1 != last && (it[1] == '=' || it[1] == '!')) {
+                    it += 2;
+                    zero_width = true;
+                } else if (at('<') || at('\'')) {
+                    char close = *it == '<' ? '>' : '\'';
+                    while (it != last && *it != close)
+                        ++it;
+                    if (it != last)
+                        ++it;
+                } else if (at('#')) {
+                    while (it != last && *it != ')')
+                        ++it;
+                    zero_width = true;
+                } else {
+                    failed = true; // options, absent operator and such
+                    return res;
+                }
+            }
+            bool group_nullable = false;
+            byteset_t group = alternation(group_nullable);
+            if (!at(')')) {
+                failed = true;
+                return res;
+            }
+            ++it;
+            if (zero_width) {
+                nullable = true;
+            } else {
+                res = group;
+                nullable = group_nullable;
+            }
+        } else if (ch == '[') {
+            ++it;
+            res = char_class();
+        } else if (ch == '\\') {
+            ++it;
+            bool zero_width;
+            res = escape(false, zero_width);
+            nullable = zero_width;
+        } else if (ch == '^' || ch == '$') {
+            ++it;
+            nullable = true;
+        } else if (ch == '.' || ch == '*' || ch == '+' || ch == '?') {
+            failed = true;
+            return res;
+        } else {
+            ++it;
+            if (ch & 0x80)
+                skip_utf8();
+            res = range((unsigned char)ch, (unsigned char)ch);
+        }
+
+        // quantifiers, with their lazy and possessive forms
+        while (!failed && it != last) {
+            if (at('*') || at('?')) {
+                nullable = true;
+                ++it;
+            } else if (at('+')) {
+                ++it;
+            } else if (at('{')) {
+                bool min_zero;
+                if (!interval(min_zero))
+                    break;
+                nullable = nullable || min_zero;
+            } else {
+                break;
+            }
+        }
+        return res;
+    }
+
+    // the first bytes of a sequence are those of its items up to the
+    // first one which can not match nothing
+    byteset_t sequence(bool& nullable)
+    {
+        byteset_t res;
+        nullable = true;
+        while (!failed && it != last && *it != '|' && *it != ')') {
+            bool item_nullable;
+            byteset_t first = item(item_nullable);
+            if (nullable)
+                res |= first;
+            nullable = nullable && item_nullable;
+        }
+        return res;
+    }
+
+    byteset_t alternation(bool& nullable)
+    {
+        byteset_t res = sequence(nullable);
+        while (!failed && at('|')) {
+            ++it;
+            bool alternative_nullable;
+            res |= sequence(alternative_nullable);
+            nullable = nullable || alternative_nullable;
+        }
+        return res;
+    }
+};
+} // namespace
+
+static std::atomic<bool> prefilter_enabled(true);
+
+void set_prefilter_enabled(bool enabled) { prefilter_enabled = enabled; }
+
+bool pattern_t::analyse(prefilter_stats_ptr const& stats)
+{
+    prefilter.reset();
+    if (!deferred && !compiled_pattern)
+        return false;
+
+    first_bytes_t parser(pattern_string);
+    bool nullable;
+    byteset_t first_bytes = parser.alternation(nullable);
+    if (parser.failed || parser.it != parser.last || nullable)
+        return false;
+
+    // too many bytes to be worth scanning for
+    if (first_bytes.count() > 128)
+        return false;
+
+    prefilter = std::make_shared<prefilter_t>();
+    prefilter->first_bytes = first_bytes;
+    prefilter->single_byte = first_bytes_t::single(first_bytes);
+    prefilter->stats = stats;
+    return true;
+}
+
+// false when a match can not begin anywhere in [from, to]
+static bool may_match(prefilter_ptr const& prefilter, char const* first,
+    char const* last, char const* from, char const* to)
+{
+    if (!prefilter || !prefilter_enabled)
+        return true;
+
+    from = from ? from : first;
+    to = to && to < last ? to + 1 : last;
+
+    bool res = false;
+    if (prefilter->single_byte != -1) {
+        res = from < to && memchr(from, prefilter->single_byte, to - from) != nullptr;
+    } else {
+        for (char const* it = from; it < to; ++it) {
+            if (prefilter->first_bytes.test((unsigned char)*it)) {
+                res = true;
+                break;
+            }
+        }
+    }
+
+    if (prefilter->stats) {
+        if (res)
+            prefilter->stats->searched.fetch_add(1, std::memory_order_relaxed);
+        else
+            prefilter->stats->skipped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return res;
+}
+
+// ================
+// = Match arenas =
+// ================
+
+namespace {
+struct arena_pool_t {
+    arena_pool_t()
+        : depth(0)
+        , records_used(0)
+        , stats()
+    {
+    }
+
+    ~arena_pool_t()
+    {
+        for (OnigRegion* region : regions)
+            onig_region_free(region, 1);
+        for (OnigRegion* region : used)
+            onig_region_free(region, 1);
+    }
+
+    OnigRegion* get()
+    {
+        stats.regions++;
+        if (regions.empty())
+            return onig_region_new();
+        stats.regions_reused++;
+        OnigRegion* res = regions.back();
+        regions.pop_back();
+        return res;
+    }
+
+    void put(OnigRegion* region) { regions.push_back(region); }
+
+    // a region kept by a match until the outermost arena ends
+    OnigRegion* get_for_match()
+    {
+        OnigRegion* res = get();
+        used.push_back(res);
+        return res;
+    }
+
+    void put_unused_match()
+    {
+        regions.push_back(used.back());
+        used.pop_back();
+    }
+
+    capture_indices_t* get_record()
+    {
+        stats.records++;
+        if (records_used < records.size()) {
+            stats.records_reused++;
+            records[records_used]->clear();
+        } else {
+            records.emplace_back(new capture_indices_t());
+        }
+        return records[records_used++].get();
+    }
+
+    void release()
+    {
+        regions.insert(regions.end(), used.begin(), used.end());
+        used.clear();
+        records_used = 0;
+    }
+
+    size_t depth;
+    std::vector<OnigRegion*> regions;
+    std::vector<OnigRegion*> used;
+    std::vector<std::unique_ptr<capture_indices_t>> records;
+    size_t records_used;
+    match_arena_stats_t stats;
+};
+
+thread_local arena_pool_t arena_pool;
+} // namespace
+
+static std::atomic<bool> match_arena_enabled(true);
+
+void set_match_arena_enabled(bool enabled) { match_arena_enabled = enabled; }
+
+match_arena_t::match_arena_t()
+    : active(arena_pool.depth > 0 || match_arena_enabled)
+{
+    if (active)
+        arena_pool.depth++;
+}
+
+match_arena_t::~match_arena_t()
+{
+    if (active && --arena_pool.depth == 0)
+        arena_pool.release();
+}
+
+OnigRegion* acquire_region() { return arena_pool.get(); }
+
+void release_region(OnigRegion* region) { arena_pool.put(region); }
+
+match_arena_stats_t match_arena_stats() { return arena_pool.stats; }
+
+// a shared pointer which does not own its object, for pooled matches
+template <typename T>
+static std::shared_ptr<T> unowned(T* ptr)
+{
+    return std::shared_ptr<T>(std::shared_ptr<T>(), ptr);
+}
+
 // ===========
 // = match_t =
 // ===========
@@ -139,8 +857,7 @@ std::map<std::string, std::string> const& match_t::captures() const
     return *captured_variables;
 }
 
-std::multimap<std::string, std::pair<size_t, size_t>> const&
-match_t::capture_indices() const
+capture_indices_t const& match_t::capture_indices() const
 {
     struct helper_t {
         static int main(OnigUChar const* name, OnigUChar const* name_end, int len,
@@ -149,23 +866,38 @@ match_t::capture_indices() const
             match_t const& m = *((match_t const*)udata);
             for (int* it = list; it != list + len; ++it) {
                 if (m.did_match(*it))
-                    m.captured_indices->insert(
+                    m.captured_indices->push_back(
                         std::make_pair(std::string(name, name_end),
                             std::make_pair(m.begin(*it), m.end(*it))));
             }
             return 0;
         }
+
+        static bool less(capture_indices_t::value_type const& lhs,
+            capture_indices_t::value_type const& rhs)
+        {
+            return lhs.first < rhs.first;
+        }
     };
 
     if (!captured_indices) {
-        captured_indices = std::make_shared<
-            std::multimap<std::string, std::pair<size_t, size_t>>>();
+        if (pooled)
+            captured_indices = unowned(arena_pool.get_record());
+        else
+            captured_indices = std::make_shared<capture_indices_t>();
         for (size_t i = 0; i < size(); ++i) {
             if (did_match(i))
-                captured_indices->insert(std::make_pair(
+                captured_indices->push_back(std::make_pair(
                     std::to_string(i), std::make_pair(begin(i), end(i))));
         }
         onig_foreach_name(compiled_pattern.get(), &helper_t::main, (void*)this);
+
+        // a stable insertion sort, there are few captures
+        capture_indices_t& indices = *captured_indices;
+        for (size_t i = 1; i < indices.size(); ++i) {
+            for (size_t j = i; j > 0 && helper_t::less(indices[j], indices[j - 1]); --j)
+                std::swap(indices[j], indices[j - 1]);
+        }
     }
     return *captured_indices;
 }
@@ -183,18 +915,27 @@ std::string match_t::operator[](size_t i) const
 match_t search(pattern_t const& ptrn, char const* first, char const* last,
     char const* from, char const* to, OnigOptionType options)
 {
-    if (ptrn) {
+    if (ptrn && may_match(ptrn.prefilter, first, last, from, to)) {
         // char const* gpos = (options & ONIG_OPTION_NOTGPOS) ? nullptr : (from ?:
         // first); options &= ~ONIG_OPTION_NOTGPOS;
 
         char const* gpos = (from ? from : first);
 
+        if (arena_pool.depth > 0) {
+            OnigRegion* region = arena_pool.get_for_match();
+            if (ONIG_MISMATCH != onig_search_gpos(ptrn.get().get(), (OnigUChar const*)first, (OnigUChar const*)last, (OnigUChar*)gpos, (OnigUChar const*)(from ? from : first), (OnigUChar const*)(to ? to : last), region, options))
+                return match_t(unowned(region), ptrn.get(), first, true);
+            arena_pool.put_unused_match();
+            return match_t();
+        }
+
         struct helper_t {
             static void region_free(OnigRegion* r) { onig_region_free(r, 1); }
         };
         regexp::region_ptr region(onig_region_new(), &helper_t::region_free);
+        arena_pool.stats.regions++;
         if (ONIG_MISMATCH != onig_search_gpos(ptrn.get().get(), (OnigUChar const*)first, (OnigUChar const*)last, (OnigUChar*)gpos, (OnigUChar const*)(from ? from : first), (OnigUChar const*)(to ? to : last), region.get(), options))
-            return match_t(region, ptrn.get(), first);
+            return match_t(region, ptrn.get(), first, false);
     }
     return match_t();
 }
@@ -204,6 +945,35 @@ match_t search(pattern_t const& ptrn, std::string const& str)
     return search(ptrn, str.data(), str.data() + str.size());
 }
 
+bool search(pattern_t const& ptrn, char const* first, char const* last,
+    char const* from, char const* to, OnigOptionType options,
+    OnigRegion* region)
+{
+    if (!ptrn || !may_match(ptrn.prefilter, first, last, from, to))
+        return false;
+
+    char const* gpos = (from ? from : first);
+    return ONIG_MISMATCH != onig_search_gpos(ptrn.get().get(), (OnigUChar const*)first, (OnigUChar const*)last, (OnigUChar*)gpos, (OnigUChar const*)(from ? from : first), (OnigUChar const*)(to ? to : last), region, options);
+}
+
+match_t copy_match(pattern_t const& ptrn, char const* first,
+    OnigRegion const* region)
+{
+    if (arena_pool.depth > 0) {
+        OnigRegion* res = arena_pool.get_for_match();
+        onig_region_copy(res, region);
+        return match_t(unowned(res), ptrn.get(), first, true);
+    }
+
+    struct helper_t {
+        static void region_free(OnigRegion* r) { onig_region_free(r, 1); }
+    };
+    regexp::region_ptr res(onig_region_new(), &helper_t::region_free);
+    arena_pool.stats.regions++;
+    onig_region_copy(res.get(), region);
+    return match_t(res, ptrn.get(), first, false);
+}
+
 // =====================
 // = Syntax validation =
 // =====================
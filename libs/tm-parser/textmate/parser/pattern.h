@@ -1,9 +1,13 @@
 #ifndef PARSE_PATTERN_H
 #define PARSE_PATTERN_H
 
+#include <atomic>
+#include <bitset>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "defines.h"
 #include "onigmognu.h"
@@ -15,35 +19,94 @@ std::map<std::string, std::string> extract_captures(OnigUChar const* buffer,
 namespace regexp {
 typedef std::shared_ptr<regex_t> regex_ptr;
 typedef std::shared_ptr<OnigRegion> region_ptr;
+typedef std::vector<std::pair<std::string, std::pair<size_t, size_t>>>
+    capture_indices_t;
 
 struct match_t;
 struct pattern_t;
 
+// searches of the patterns of a grammar, and how many the prefilter skipped
+struct prefilter_stats_t {
+    prefilter_stats_t()
+        : searched(0)
+        , skipped(0)
+    {
+    }
+    std::atomic<size_t> searched;
+    std::atomic<size_t> skipped;
+};
+
+// the bytes a match can begin with. a search is skipped when none of them
+// is found where a match could begin
+struct prefilter_t {
+    std::bitset<256> first_bytes;
+    int single_byte; // searched with memchr, -1 if there are more
+    std::shared_ptr<prefilter_stats_t> stats;
+};
+
+typedef std::shared_ptr<prefilter_stats_t> prefilter_stats_ptr;
+typedef std::shared_ptr<prefilter_t> prefilter_ptr;
+
+// a pattern compiled on its first use, shared by the copies of a pattern_t
+struct deferred_pattern_t {
+    deferred_pattern_t()
+        : compiled(false)
+    {
+    }
+    std::atomic<bool> compiled;
+    std::mutex mutex;
+    OnigOptionType options;
+    regex_ptr compiled_pattern;
+};
+
+typedef std::shared_ptr<deferred_pattern_t> deferred_pattern_ptr;
+
+// compiles of patterns, and lookups which found the same pattern string
+// and options already compiled, with the memory and time that saved
+struct pattern_registry_stats_t {
+    size_t compiled;
+    size_t shared;
+    size_t bytes_compiled;
+    size_t bytes_saved;
+    double seconds_compiled;
+    double seconds_saved;
+};
+
+// patterns made to be compiled on first use, and how many of those were
+struct pattern_compile_stats_t {
+    size_t deferred;
+    size_t compiled;
+};
+
 struct match_t {
 private:
     region_ptr region;
     regex_ptr compiled_pattern;
     char const* buf;
+    bool pooled; // region and capture indices belong to a match_arena_t
 
     mutable std::shared_ptr<std::map<std::string, std::string>>
         captured_variables;
-    mutable std::shared_ptr<std::multimap<std::string, std::pair<size_t, size_t>>>
-        captured_indices;
+    mutable std::shared_ptr<capture_indices_t> captured_indices;
 
     friend match_t search(pattern_t const& ptrn, char const* first,
         char const* last, char const* from, char const* to,
         OnigOptionType options);
+    friend match_t copy_match(pattern_t const& ptrn, char const* first,
+        OnigRegion const* region);
     match_t(region_ptr const& region, regex_ptr const& compiled_pattern,
-        char const* buf)
+        char const* buf, bool pooled)
         : region(region)
         , compiled_pattern(compiled_pattern)
         , buf(buf)
+        , pooled(pooled)
     {
     }
 
 public:
     match_t()
         : buf(NULL)
+        , pooled(false)
     {
     }
 
@@ -74,8 +137,8 @@ public:
     }
 
     std::map<std::string, std::string> const& captures() const;
-    std::multimap<std::string, std::pair<size_t, size_t>> const&
-    capture_indices() const;
+    // sorted by name, as repository keys are
+    capture_indices_t const& capture_indices() const;
     std::string operator[](size_t i) const;
 };
 
@@ -83,13 +146,21 @@ struct pattern_t {
     // WATCH_LEAKS(regexp::pattern_t);
 private:
     regex_ptr compiled_pattern;
+    deferred_pattern_ptr deferred;
     std::string pattern_string;
+    prefilter_ptr prefilter;
     void init(std::string const& pattern, OnigOptionType options);
+    regex_ptr compile() const;
 
     friend match_t search(pattern_t const& ptrn, char const* first,
         char const* last, char const* from, char const* to,
         OnigOptionType options);
-    regex_ptr get() const { return compiled_pattern; }
+    friend bool search(pattern_t const& ptrn, char const* first,
+        char const* last, char const* from, char const* to,
+        OnigOptionType options, OnigRegion* region);
+    friend match_t copy_match(pattern_t const& ptrn, char const* first,
+        OnigRegion const* region);
+    regex_ptr get() const { return deferred ? compile() : compiled_pattern; }
 
 public:
     pattern_t()
@@ -100,7 +171,13 @@ public:
     pattern_t(std::string const& pattern,
         OnigOptionType options = ONIG_OPTION_NONE);
     pattern_t(std::string const& pattern, std::string const& str_options);
-    explicit operator bool() const { return compiled_pattern ? true : false; }
+    // compiled when first searched or tested, if deferred patterns are enabled
+    pattern_t(std::string const& pattern, OnigOptionType options, bool defer);
+    // false if the pattern does not compile, a deferred pattern is compiled
+    explicit operator bool() const { return get() ? true : false; }
+
+    // derive a prefilter from the pattern string, false if no useful one
+    bool analyse(prefilter_stats_ptr const& stats);
 
     bool operator==(pattern_t const& rhs) const
     {
@@ -120,6 +197,56 @@ match_t search(pattern_t const& ptrn, char const* first, char const* last,
     OnigOptionType options = ONIG_OPTION_NONE);
 match_t search(pattern_t const& ptrn, std::string const& str);
 
+// prefilters can be turned off, to measure what they save
+void set_prefilter_enabled(bool enabled);
+
+// deferred patterns can be turned off, they are then compiled when made
+void set_deferred_patterns_enabled(bool enabled);
+pattern_compile_stats_t pattern_compile_stats();
+
+// equal patterns share one compiled regex while any of them lives. the
+// registry can be turned off, to measure what it saves
+void set_pattern_registry_enabled(bool enabled);
+pattern_registry_stats_t pattern_registry_stats();
+
+// search into a region owned by the caller, which is reused across searches
+// copy_match makes a match_t that outlives the region contents
+bool search(pattern_t const& ptrn, char const* first, char const* last,
+    char const* from, char const* to, OnigOptionType options,
+    OnigRegion* region);
+match_t copy_match(pattern_t const& ptrn, char const* first,
+    OnigRegion const* region);
+
+// while an arena lives, matches found on its thread take their region and
+// capture indices from a per thread pool instead of the heap. they go back
+// to the pool when the outermost arena ends, matches must not outlive it
+struct match_arena_t {
+    match_arena_t();
+    ~match_arena_t();
+
+private:
+    match_arena_t(match_arena_t const&);
+    match_arena_t& operator=(match_arena_t const&);
+    bool active;
+};
+
+// regions for callers which keep them longer than a match, from the pool
+OnigRegion* acquire_region();
+void release_region(OnigRegion* region);
+
+// regions and capture index records made on this thread, and how many of
+// those were taken from the pool instead
+struct match_arena_stats_t {
+    size_t regions;
+    size_t regions_reused;
+    size_t records;
+    size_t records_reused;
+};
+match_arena_stats_t match_arena_stats();
+
+// arenas can be turned off, to measure what they save
+void set_match_arena_enabled(bool enabled);
+
 } // namespace regexp
 
 #endif
\ No newline at end of file
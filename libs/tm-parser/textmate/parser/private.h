@@ -1,6 +1,7 @@
 #ifndef PARSE_PRIVATE_H
 #define PARSE_PRIVATE_H
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <vector>
@@ -12,15 +13,17 @@
 namespace parse {
 
 struct rule_t;
+struct candidates_t;
 
 typedef std::shared_ptr<rule_t> rule_ptr;
+typedef std::shared_ptr<candidates_t> candidates_ptr;
 typedef std::weak_ptr<rule_t> rule_weak_ptr;
 typedef std::map<std::string, rule_ptr> repository_t;
 typedef std::shared_ptr<repository_t> repository_ptr;
 
 struct rule_t {
 
-    static size_t rule_id_counter;
+    static std::atomic<size_t> rule_id_counter;
 
     rule_t()
         : rule_id(++rule_id_counter)
@@ -70,12 +73,14 @@ struct rule_t {
     regexp::pattern_t end_pattern;
     bool match_pattern_is_anchored = false;
 
-    // =================
-    // = Mutable State =
-    // =================
-
-    bool included = false;
     bool is_root = false;
+    std::atomic<bool> const* ready = nullptr; // of the grammar owning the rule
+
+    // ==========
+    // = Caches =
+    // ==========
+
+    candidates_ptr candidates; // rules tried in this context, see collect_rules
 };
 
 struct stack_t;
@@ -90,6 +95,9 @@ struct stack_t {
         , rule(rule)
         , scope(scope)
         , anchor(0)
+        , zw_begin_match(false)
+        , apply_end_last(false)
+        , interned(false)
     {
     }
 
@@ -107,6 +115,7 @@ struct stack_t {
     size_t anchor;
     bool zw_begin_match;
     bool apply_end_last;
+    bool interned; // shared by lines ending in this state, never changed
 
     bool operator==(stack_t const& rhs) const;
     bool operator!=(stack_t const& rhs) const;
@@ -1,10 +1,25 @@
 #include "reader.h"
 #include "pattern.h"
 
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <sys/stat.h>
+#include <unordered_map>
 #include <vector>
 
+#ifndef WIN64
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace parse {
 
 static bool convert_array(Json::Value const& patterns,
@@ -217,4 +232,1085 @@ Json::Value loadJson(std::string filename)
     return root;
 }
 
+// ===============
+// = Rules cache =
+// ===============
+
+// a cache file is the header, the source path, then tables of rules,
+// children (rule indices), repository entries and strings. strings are
+// a length followed by the bytes, referred to by offset. the file is only
+// read on the machine that wrote it, values are in native order
+
+static char const cache_magic[8] = { 'T', 'M', 'R', 'U', 'L', 'E', 'S', 0 };
+static uint32_t const cache_version = 1;
+static uint32_t const cache_none = 0xffffffff;
+
+struct cache_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t path_length;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t rule_count;
+    uint32_t child_count;
+    uint32_t entry_count;
+    uint32_t string_bytes;
+};
+
+enum {
+    cache_include,
+    cache_scope,
+    cache_content_scope,
+    cache_match,
+    cache_while,
+    cache_end,
+    cache_apply_end_last,
+    cache_string_count
+};
+
+enum {
+    cache_captures,
+    cache_begin_captures,
+    cache_while_captures,
+    cache_end_captures,
+    cache_repository,
+    cache_injection_rules,
+    cache_map_count
+};
+
+struct cache_rule_t {
+    uint32_t strings[cache_string_count];
+    uint32_t first_child;
+    uint32_t children;
+    uint32_t first_entry[cache_map_count];
+    uint32_t entries[cache_map_count]; // cache_none if there is no map
+};
+
+struct cache_entry_t {
+    uint32_t name;
+    uint32_t rule;
+};
+
+static std::string* rule_strings(rule_t* rule, int i)
+{
+    std::string* strings[] = { &rule->include_string, &rule->scope_string,
+        &rule->content_scope_string, &rule->match_string, &rule->while_string,
+        &rule->end_string, &rule->apply_end_last };
+    return strings[i];
+}
+
+static repository_ptr* rule_maps(rule_t* rule, int i)
+{
+    repository_ptr* maps[] = { &rule->captures, &rule->begin_captures,
+        &rule->while_captures, &rule->end_captures, &rule->repository,
+        &rule->injection_rules };
+    return maps[i];
+}
+
+static bool source_stat(std::string const& path, uint64_t& size, int64_t& mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    size = st.st_size;
+    mtime = st.st_mtime;
+    return true;
+}
+
+struct cache_writer_t {
+    std::vector<cache_rule_t> rules;
+    std::vector<uint32_t> children;
+    std::vector<cache_entry_t> entries;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> offsets;
+
+    uint32_t add_string(std::string const& str)
+    {
+        auto it = offsets.find(str);
+        if (it != offsets.end()) {
+            return it->second;
+        }
+        uint32_t offset = strings.size();
+        uint32_t length = str.length();
+        strings.append((char const*)&length, sizeof(length));
+        strings.append(str);
+        offsets.emplace(str, offset);
+        return offset;
+    }
+
+    // rules are numbered in the order they are reached, the root is 0
+    uint32_t add_rule(rule_t* rule)
+    {
+        uint32_t index = rules.size();
+        rules.emplace_back();
+
+        cache_rule_t res;
+        for (int i = 0; i < cache_string_count; i++) {
+            res.strings[i] = add_string(*rule_strings(rule, i));
+        }
+
+        std::vector<uint32_t> kids;
+        for (auto const& child : rule->children) {
+            kids.push_back(add_rule(child.get()));
+        }
+        res.first_child = children.size();
+        res.children = kids.size();
+        children.insert(children.end(), kids.begin(), kids.end());
+
+        for (int i = 0; i < cache_map_count; i++) {
+            repository_ptr map = *rule_maps(rule, i);
+            res.first_entry[i] = 0;
+            res.entries[i] = cache_none;
+            if (!map) {
+                continue;
+            }
+            std::vector<cache_entry_t> items;
+            for (auto const& pair : *map) {
+                cache_entry_t entry = { add_string(pair.first),
+                    add_rule(pair.second.get()) };
+                items.push_back(entry);
+            }
+            res.first_entry[i] = entries.size();
+            res.entries[i] = items.size();
+            entries.insert(entries.end(), items.begin(), items.end());
+        }
+
+        rules[index] = res;
+        return index;
+    }
+};
+
+bool write_cached_rules(std::string const& cache_path,
+    std::string const& source, rule_ptr const& rule)
+{
+    cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (!source_stat(source, header.source_size, header.source_mtime)) {
+        return false;
+    }
+
+    cache_writer_t writer;
+    writer.add_rule(rule.get());
+
+    memcpy(header.magic, cache_magic, sizeof(header.magic));
+    header.version = cache_version;
+    header.path_length = source.length();
+    header.rule_count = writer.rules.size();
+    header.child_count = writer.children.size();
+    header.entry_count = writer.entries.size();
+    header.string_bytes = writer.strings.size();
+
+    // written aside and renamed, a reader never sees half a file
+    static std::atomic<int> counter(0);
+    std::string tmp = cache_path + "." + std::to_string(++counter) + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    std::string path = source;
+    path.resize((path.length() + 3) & ~3, '\0');
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(path.data(), 1, path.length(), file) == path.length()
+        && fwrite(writer.rules.data(), sizeof(cache_rule_t), writer.rules.size(), file) == writer.rules.size()
+        && fwrite(writer.children.data(), sizeof(uint32_t), writer.children.size(), file) == writer.children.size()
+        && fwrite(writer.entries.data(), sizeof(cache_entry_t), writer.entries.size(), file) == writer.entries.size()
+        && fwrite(writer.strings.data(), 1, writer.strings.size(), file) == writer.strings.size();
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(tmp.c_str(), cache_path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the tables of a cache file, checked before any rule is made
+struct cache_reader_t {
+    cache_header_t const* header;
+    cache_rule_t const* rules;
+    uint32_t const* children;
+    cache_entry_t const* entries;
+    char const* strings;
+
+    bool setup(char const* data, size_t size, std::string const& source)
+    {
+        if (size < sizeof(cache_header_t)) {
+            return false;
+        }
+        header = (cache_header_t const*)data;
+        if (memcmp(header->magic, cache_magic, sizeof(header->magic)) != 0
+            || header->version != cache_version
+            || header->path_length != source.length()) {
+            return false;
+        }
+
+        uint64_t source_size;
+        int64_t source_mtime;
+        if (!source_stat(source, source_size, source_mtime)
+            || source_size != header->source_size
+            || source_mtime != header->source_mtime) {
+            return false;
+        }
+
+        uint64_t path_bytes = (header->path_length + 3) & ~3;
+        uint64_t expected = sizeof(cache_header_t) + path_bytes
+            + (uint64_t)header->rule_count * sizeof(cache_rule_t)
+            + (uint64_t)header->child_count * sizeof(uint32_t)
+            + (uint64_t)header->entry_count * sizeof(cache_entry_t)
+            + header->string_bytes;
+        if (expected != size || header->rule_count == 0
+            || memcmp(data + sizeof(cache_header_t), source.data(), source.length()) != 0) {
+            return false;
+        }
+
+        char const* p = data + sizeof(cache_header_t) + path_bytes;
+        rules = (cache_rule_t const*)p;
+        p += header->rule_count * sizeof(cache_rule_t);
+        children = (uint32_t const*)p;
+        p += header->child_count * sizeof(uint32_t);
+        entries = (cache_entry_t const*)p;
+        p += header->entry_count * sizeof(cache_entry_t);
+        strings = p;
+
+        for (uint32_t r = 0; r < header->rule_count; r++) {
+            cache_rule_t const& rule = rules[r];
+            for (int i = 0; i < cache_string_count; i++) {
+                if (!valid_string(rule.strings[i])) {
+                    return false;
+                }
+            }
+            if ((uint64_t)rule.first_child + rule.children > header->child_count) {
+                return false;
+            }
+            for (int i = 0; i < cache_map_count; i++) {
+                if (rule.entries[i] != cache_none
+                    && (uint64_t)rule.first_entry[i] + rule.entries[i] > header->entry_count) {
+                    return false;
+                }
+            }
+        }
+        for (uint32_t c = 0; c < header->child_count; c++) {
+            if (children[c] >= header->rule_count) {
+                return false;
+            }
+        }
+        for (uint32_t e = 0; e < header->entry_count; e++) {
+            if (entries[e].rule >= header->rule_count || !valid_string(entries[e].name)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool valid_string(uint32_t offset) const
+    {
+        uint32_t length;
+        if ((uint64_t)offset + sizeof(length) > header->string_bytes) {
+            return false;
+        }
+        memcpy(&length, strings + offset, sizeof(length));
+        return (uint64_t)offset + sizeof(length) + length <= header->string_bytes;
+    }
+
+    std::string string(uint32_t offset) const
+    {
+        uint32_t length;
+        memcpy(&length, strings + offset, sizeof(length));
+        return std::string(strings + offset + sizeof(length), length);
+    }
+
+    void build(rule_ptr const& target) const
+    {
+        std::vector<rule_ptr> res(header->rule_count);
+        res[0] = target;
+        for (uint32_t r = 1; r < header->rule_count; r++) {
+            res[r] = std::make_shared<rule_t>();
+        }
+
+        for (uint32_t r = 0; r < header->rule_count; r++) {
+            cache_rule_t const& rule = rules[r];
+            rule_t* dest = res[r].get();
+            for (int i = 0; i < cache_string_count; i++) {
+                *rule_strings(dest, i) = string(rule.strings[i]);
+            }
+            for (uint32_t c = 0; c < rule.children; c++) {
+                dest->children.push_back(res[children[rule.first_child + c]]);
+            }
+            for (int i = 0; i < cache_map_count; i++) {
+                if (rule.entries[i] == cache_none) {
+                    continue;
+                }
+                repository_ptr map = std::make_shared<repository_t>();
+                for (uint32_t e = 0; e < rule.entries[i]; e++) {
+                    cache_entry_t const& entry = entries[rule.first_entry[i] + e];
+                    map->emplace(string(entry.name), res[entry.rule]);
+                }
+                *rule_maps(dest, i) = map;
+            }
+        }
+    }
+};
+
+bool read_cached_rules(std::string const& cache_path,
+    std::string const& source, rule_ptr const& target)
+{
+    bool res = false;
+#ifndef WIN64
+    int fd = open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            cache_reader_t reader;
+            if (reader.setup((char const*)data, st.st_size, source)) {
+                reader.build(target);
+                res = true;
+            }
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+#else
+    std::ifstream file(cache_path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+    cache_reader_t reader;
+    if (reader.setup(data.data(), data.size(), source)) {
+        reader.build(target);
+        res = true;
+    }
+#endif
+    return res;
+}
+
+// ====================
+// = Streaming reader =
+// ====================
+
+// grammar files are read straight into rules, without a Json::Value or an
+// XML document in between. keys mean what they mean to convert_json: the
+// last of a repeated key wins, scopeName over name and begin over match.
+// a value of another type than convert_json takes is skipped
+
+struct rule_fields_t {
+    rule_fields_t(rule_t* rule)
+        : rule(rule)
+        , scope_name(false)
+        , begin(false)
+    {
+    }
+
+    void set(std::string const& key, std::string const& value)
+    {
+        if (key == "name") {
+            if (!scope_name)
+                rule->scope_string = value;
+        } else if (key == "scopeName") {
+            rule->scope_string = value;
+            scope_name = true;
+        } else if (key == "contentName") {
+            rule->content_scope_string = value;
+        } else if (key == "match") {
+            if (!begin)
+                rule->match_string = value;
+        } else if (key == "begin") {
+            rule->match_string = value;
+            begin = true;
+        } else if (key == "while") {
+            rule->while_string = value;
+        } else if (key == "end") {
+            rule->end_string = value;
+        } else if (key == "applyEndPatternLast") {
+            rule->apply_end_last = value;
+        } else if (key == "include") {
+            rule->include_string = value;
+        }
+    }
+
+    // the map of key, replaced by an empty one. null if key is not a map
+    repository_t* map(std::string const& key)
+    {
+        repository_ptr* res = nullptr;
+        if (key == "captures") {
+            res = &rule->captures;
+        } else if (key == "beginCaptures") {
+            res = &rule->begin_captures;
+        } else if (key == "whileCaptures") {
+            res = &rule->while_captures;
+        } else if (key == "endCaptures") {
+            res = &rule->end_captures;
+        } else if (key == "repository") {
+            res = &rule->repository;
+        } else if (key == "injections") {
+            res = &rule->injection_rules;
+        }
+        if (!res) {
+            return nullptr;
+        }
+        *res = std::make_shared<repository_t>();
+        return res->get();
+    }
+
+    rule_t* rule;
+    bool scope_name;
+    bool begin;
+};
+
+static void append_utf8(std::string& res, uint32_t cp)
+{
+    if (cp < 0x80) {
+        res += (char)cp;
+    } else if (cp < 0x800) {
+        res += (char)(0xc0 | (cp >> 6));
+        res += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        res += (char)(0xe0 | (cp >> 12));
+        res += (char)(0x80 | ((cp >> 6) & 0x3f));
+        res += (char)(0x80 | (cp & 0x3f));
+    } else {
+        res += (char)(0xf0 | (cp >> 18));
+        res += (char)(0x80 | ((cp >> 12) & 0x3f));
+        res += (char)(0x80 | ((cp >> 6) & 0x3f));
+        res += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+static void skip_bom(char const*& p, char const* end)
+{
+    if (end - p >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) {
+        p += 3;
+    }
+}
+
+// json as loadJson takes it, with comments and trailing commas
+struct json_rule_reader_t {
+    char const* p;
+    char const* end;
+
+    void skip_space()
+    {
+        while (p < end) {
+            if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+                p++;
+            } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+                while (p < end && *p != '\n')
+                    p++;
+            } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+                char const* close = p + 2;
+                while (close + 1 < end && !(close[0] == '*' && close[1] == '/'))
+                    close++;
+                p = close + 1 < end ? close + 2 : end;
+            } else {
+                break;
+            }
+        }
+    }
+
+    bool peek(char c)
+    {
+        skip_space();
+        return p < end && *p == c;
+    }
+
+    bool next(char c)
+    {
+        if (!peek(c)) {
+            return false;
+        }
+        p++;
+        return true;
+    }
+
+    bool read_hex(uint32_t& res)
+    {
+        if (end - p < 4) {
+            return false;
+        }
+        res = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = *p++;
+            res <<= 4;
+            if (c >= '0' && c <= '9') {
+                res |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                res |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                res |= c - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool read_string(std::string& res)
+    {
+        if (!next('"')) {
+            return false;
+        }
+        res.clear();
+        while (true) {
+            char const* run = p;
+            while (p < end && *p != '"' && *p != '\\')
+                p++;
+            res.append(run, p - run);
+            if (p >= end) {
+                return false;
+            }
+            if (*p++ == '"') {
+                return true;
+            }
+            if (p >= end) {
+                return false;
+            }
+            char c = *p++;
+            switch (c) {
+            case 'b':
+                res += '\b';
+                break;
+            case 'f':
+                res += '\f';
+                break;
+            case 'n':
+                res += '\n';
+                break;
+            case 'r':
+                res += '\r';
+                break;
+            case 't':
+                res += '\t';
+                break;
+            case 'u': {
+                uint32_t cp;
+                if (!read_hex(cp)) {
+                    return false;
+                }
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    uint32_t low;
+                    if (end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+                        return false;
+                    }
+                    p += 2;
+                    if (!read_hex(low) || low < 0xdc00 || low > 0xdfff) {
+                        return false;
+                    }
+                    cp = 0x10000 + ((cp & 0x3ff) << 10) + (low & 0x3ff);
+                }
+                append_utf8(res, cp);
+                break;
+            }
+            case '"':
+            case '\\':
+            case '/':
+                res += c;
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+
+    // as asString gives them, null is an empty string
+    bool read_scalar(std::string& res)
+    {
+        skip_space();
+        if (p < end && *p == '"') {
+            return read_string(res);
+        }
+        char const* words[] = { "true", "false", "null" };
+        for (int i = 0; i < 3; i++) {
+            size_t length = strlen(words[i]);
+            if ((size_t)(end - p) >= length && memcmp(p, words[i], length) == 0) {
+                p += length;
+                res = i < 2 ? words[i] : "";
+                return true;
+            }
+        }
+        char const* start = p;
+        bool real = false;
+        while (p < end && (isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E')) {
+            real = real || *p == '.' || *p == 'e' || *p == 'E';
+            p++;
+        }
+        if (p == start) {
+            return false;
+        }
+        std::string number(start, p - start);
+        if (real) {
+            res = Json::Value(strtod(number.c_str(), nullptr)).asString();
+        } else {
+            res = Json::Value((Json::Int64)strtoll(number.c_str(), nullptr, 10)).asString();
+        }
+        return true;
+    }
+
+    // member runs for each key of an object, before its value is read
+    template <typename F>
+    bool read_object(F member)
+    {
+        if (!next('{')) {
+            return false;
+        }
+        std::string key;
+        while (!next('}')) {
+            if (!read_string(key) || !next(':') || !member(key)) {
+                return false;
+            }
+            if (!next(',') && !peek('}')) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename F>
+    bool read_array(F element)
+    {
+        if (!next('[')) {
+            return false;
+        }
+        while (!next(']')) {
+            if (!element() || (!next(',') && !peek(']'))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool skip_value()
+    {
+        if (peek('{')) {
+            return read_object([this](std::string const&) -> bool { return skip_value(); });
+        }
+        if (peek('[')) {
+            return read_array([this]() -> bool { return skip_value(); });
+        }
+        std::string value;
+        return read_scalar(value);
+    }
+
+    // a value other than an object is an empty rule
+    bool read_rule(rule_ptr& res)
+    {
+        res = std::make_shared<rule_t>();
+        return peek('{') ? read_rule(res.get()) : skip_value();
+    }
+
+    bool read_rule(rule_t* rule)
+    {
+        rule_fields_t fields(rule);
+        return read_object([this, rule, &fields](std::string const& key) -> bool {
+            if (repository_t* map = fields.map(key)) {
+                if (!peek('{')) {
+                    return skip_value();
+                }
+                return read_object([this, map](std::string const& name) -> bool {
+                    return read_rule((*map)[name]);
+                });
+            }
+            if (key == "patterns") {
+                rule->children.clear();
+                if (!peek('[')) {
+                    return skip_value();
+                }
+                return read_array([this, rule]() -> bool {
+                    rule->children.emplace_back();
+                    return read_rule(rule->children.back());
+                });
+            }
+            if (peek('{') || peek('[')) {
+                return skip_value();
+            }
+            std::string value;
+            if (!read_scalar(value)) {
+                return false;
+            }
+            fields.set(key, value);
+            return true;
+        });
+    }
+
+    // what follows the root object is not read
+    bool read(rule_t* rule)
+    {
+        skip_bom(p, end);
+        return read_rule(rule);
+    }
+};
+
+#ifndef DISABLE_PLIST_GRAMMARS
+// the plist dictionaries, arrays and strings load_plist_or_json takes from
+// a tinyxml2 document. other elements are skipped
+struct plist_rule_reader_t {
+    char const* p;
+    char const* end;
+
+    bool starts(char const* str)
+    {
+        size_t length = strlen(str);
+        return (size_t)(end - p) >= length && memcmp(p, str, length) == 0;
+    }
+
+    // past the next str, false if there is none
+    bool skip_past(char const* str)
+    {
+        size_t length = strlen(str);
+        while ((size_t)(end - p) >= length) {
+            if (memcmp(p, str, length) == 0) {
+                p += length;
+                return true;
+            }
+            p++;
+        }
+        p = end;
+        return false;
+    }
+
+    // comments, declarations and processing instructions, p is at '<'
+    bool skip_markup()
+    {
+        if (starts("<!--")) {
+            return skip_past("-->");
+        }
+        if (starts("<![CDATA[")) {
+            return skip_past("]]>");
+        }
+        if (starts("<?")) {
+            return skip_past("?>");
+        }
+        // a doctype may hold declarations in brackets
+        int depth = 0;
+        for (p += 2; p < end; p++) {
+            if (*p == '[') {
+                depth++;
+            } else if (*p == ']') {
+                depth--;
+            } else if (*p == '>' && depth <= 0) {
+                p++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the next tag, text between tags is skipped. closing is set for
+    // </name>, empty for <name/>
+    bool next_tag(std::string& name, bool& closing, bool& empty)
+    {
+        while (true) {
+            while (p < end && *p != '<')
+                p++;
+            if (p + 1 >= end) {
+                return false;
+            }
+            if (p[1] == '!' || p[1] == '?') {
+                if (!skip_markup()) {
+                    return false;
+                }
+                continue;
+            }
+            p++;
+            closing = *p == '/';
+            if (closing) {
+                p++;
+            }
+            char const* start = p;
+            while (p < end && !isspace((unsigned char)*p) && *p != '/' && *p != '>')
+                p++;
+            name.assign(start, p - start);
+            char quote = 0;
+            for (; p < end; p++) {
+                if (quote) {
+                    if (*p == quote)
+                        quote = 0;
+                } else if (*p == '"' || *p == '\'') {
+                    quote = *p;
+                } else if (*p == '>') {
+                    break;
+                }
+            }
+            if (p >= end || name.empty()) {
+                return false;
+            }
+            empty = !closing && p[-1] == '/';
+            p++;
+            return true;
+        }
+    }
+
+    void read_entity(std::string& res)
+    {
+        struct {
+            char const* name;
+            char value;
+        } entities[] = { { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+            { "&quot;", '"' }, { "&apos;", '\'' } };
+        for (auto const& entity : entities) {
+            if (starts(entity.name)) {
+                res += entity.value;
+                p += strlen(entity.name);
+                return;
+            }
+        }
+        if (starts("&#")) {
+            char const* q = p + 2;
+            bool hex = q < end && (*q == 'x' || *q == 'X');
+            if (hex) {
+                q++;
+            }
+            uint32_t cp = 0;
+            char const* digits = q;
+            while (q < end && (hex ? isxdigit((unsigned char)*q) : isdigit((unsigned char)*q))) {
+                cp = cp * (hex ? 16 : 10) + (isdigit((unsigned char)*q) ? *q - '0' : (tolower((unsigned char)*q) - 'a' + 10));
+                if (cp > 0x10ffff) {
+                    break;
+                }
+                q++;
+            }
+            if (q > digits && q < end && *q == ';' && cp <= 0x10ffff) {
+                append_utf8(res, cp);
+                p = q + 1;
+                return;
+            }
+        }
+        // kept as written, as tinyxml2 does
+        res += *p++;
+    }
+
+    // the text of an element up to </name>. line ends become '\n'
+    bool read_text(std::string const& name, std::string& res)
+    {
+        res.clear();
+        while (p < end) {
+            char const* run = p;
+            while (p < end && *p != '<' && *p != '&' && *p != '\r')
+                p++;
+            res.append(run, p - run);
+            if (p >= end) {
+                return false;
+            }
+            if (*p == '&') {
+                read_entity(res);
+            } else if (*p == '\r') {
+                res += '\n';
+                p++;
+                if (p < end && *p == '\n') {
+                    p++;
+                }
+            } else if (starts("<![CDATA[")) {
+                p += 9;
+                char const* start = p;
+                if (!skip_past("]]>")) {
+                    return false;
+                }
+                res.append(start, p - 3 - start);
+            } else if (starts("<!--")) {
+                if (!skip_past("-->")) {
+                    return false;
+                }
+            } else {
+                std::string tag;
+                bool closing, empty;
+                return next_tag(tag, closing, empty) && closing && tag == name;
+            }
+        }
+        return false;
+    }
+
+    // the text of an element whose start tag was read
+    bool read_value(std::string const& name, bool empty, std::string& res)
+    {
+        if (empty) {
+            res.clear();
+            return true;
+        }
+        return read_text(name, res);
+    }
+
+    bool skip_element(bool empty)
+    {
+        std::string name;
+        bool closing;
+        for (int depth = empty ? 0 : 1; depth > 0;) {
+            if (!next_tag(name, closing, empty)) {
+                return false;
+            }
+            if (closing) {
+                depth--;
+            } else if (!empty) {
+                depth++;
+            }
+        }
+        return true;
+    }
+
+    // an empty rule for a string or an array, as convert_json makes
+    bool read_rule(std::string const& name, bool empty, rule_ptr& res)
+    {
+        res = std::make_shared<rule_t>();
+        if (name == "dict") {
+            return empty || read_rule(res.get());
+        }
+        std::string value;
+        return name == "string" ? read_value(name, empty, value) : skip_element(empty);
+    }
+
+    bool is_value(std::string const& name)
+    {
+        return name == "string" || name == "dict" || name == "array";
+    }
+
+    // the keys and values of a dictionary up to </dict>
+    template <typename F>
+    bool read_dict(F member)
+    {
+        std::string key;
+        std::string name;
+        bool closing, empty;
+        while (next_tag(name, closing, empty)) {
+            if (closing) {
+                return name == "dict";
+            }
+            bool read = true;
+            if (name == "key") {
+                read = read_value(name, empty, key);
+            } else if (is_value(name)) {
+                read = member(key, name, empty);
+            } else {
+                read = skip_element(empty);
+            }
+            if (!read) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool read_rule(rule_t* rule)
+    {
+        rule_fields_t fields(rule);
+        return read_dict([this, rule, &fields](std::string const& key, std::string const& name, bool empty) -> bool {
+            if (repository_t* map = fields.map(key)) {
+                if (name != "dict" || empty) {
+                    return name == "string" ? skip_string(empty) : skip_element(empty);
+                }
+                return read_dict([this, map](std::string const& entry, std::string const& type, bool none) -> bool {
+                    return read_rule(type, none, (*map)[entry]);
+                });
+            }
+            if (key == "patterns") {
+                rule->children.clear();
+                if (name != "array" || empty) {
+                    return name == "string" ? skip_string(empty) : skip_element(empty);
+                }
+                return read_array(rule->children);
+            }
+            if (name != "string") {
+                return skip_element(empty);
+            }
+            std::string value;
+            if (!read_value(name, empty, value)) {
+                return false;
+            }
+            fields.set(key, value);
+            return true;
+        });
+    }
+
+    bool skip_string(bool empty)
+    {
+        std::string value;
+        return read_value("string", empty, value);
+    }
+
+    // the rules of an array up to </array>
+    bool read_array(std::vector<rule_ptr>& res)
+    {
+        std::string name;
+        bool closing, empty;
+        while (next_tag(name, closing, empty)) {
+            if (closing) {
+                return name == "array";
+            }
+            bool read = true;
+            if (is_value(name)) {
+                res.emplace_back();
+                read = read_rule(name, empty, res.back());
+            } else {
+                read = skip_element(empty);
+            }
+            if (!read) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // only the first element in the root element is read, a dictionary
+    bool read(rule_t* rule)
+    {
+        skip_bom(p, end);
+        std::string name;
+        bool closing, empty;
+        if (!next_tag(name, closing, empty) || closing) {
+            return false;
+        }
+        if (empty || !next_tag(name, closing, empty) || closing) {
+            return true;
+        }
+        if (name != "dict") {
+            return false;
+        }
+        return empty || read_rule(rule);
+    }
+};
+#endif
+
+static bool read_file(std::string const& path, std::string& data)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    data.assign((std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+    return true;
+}
+
+bool read_rules(std::string const& path, rule_ptr const& target)
+{
+    std::string data;
+    if (!read_file(path, data)) {
+        return false;
+    }
+
+    bool res = false;
+    if (path.find(".json") != std::string::npos) {
+        json_rule_reader_t reader = { data.data(), data.data() + data.size() };
+        res = reader.read(target.get());
+    } else {
+#ifndef DISABLE_PLIST_GRAMMARS
+        plist_rule_reader_t reader = { data.data(), data.data() + data.size() };
+        res = reader.read(target.get());
+#endif
+    }
+
+    // left as it was for the document readers
+    if (!res) {
+        for (int i = 0; i < cache_string_count; i++) {
+            *rule_strings(target.get(), i) = NULL_STR;
+        }
+        for (int i = 0; i < cache_map_count; i++) {
+            rule_maps(target.get(), i)->reset();
+        }
+        target->children.clear();
+    }
+    return res;
+}
+
 } // namespace parse
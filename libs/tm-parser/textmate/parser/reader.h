@@ -16,6 +16,19 @@ Json::Value rule_to_json(rule_ptr const& rule);
 
 Json::Value loadJson(std::string filename);
 
+// read a .json or plist grammar file straight into target, without a
+// Json::Value document. false, with target left empty, if the file is
+// not read
+bool read_rules(std::string const& path, rule_ptr const& target);
+
+// the rule tree of a grammar file in a binary form, to be read back while
+// the source file has the size and modification time it was written from.
+// read_cached_rules fills target only from a valid cache
+bool write_cached_rules(std::string const& cache_path,
+    std::string const& source, rule_ptr const& rule);
+bool read_cached_rules(std::string const& cache_path,
+    std::string const& source, rule_ptr const& target);
+
 } // namespace parse
 
 #endif
\ No newline at end of file
@@ -5,7 +5,10 @@
 #include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace scope {
 scope_t wildcard("x-any");
@@ -37,15 +40,129 @@ std::vector<std::string> text_tokenize(std::string string, char separator)
     return res;
 }
 
+// order dependent, a plain xor maps "a b" and "b a" (or "a x x") together
+static size_t hash_combine(size_t seed, size_t hash)
+{
+    return seed ^ (hash + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+// ===============
+// = Scope table =
+// ===============
+
+// interned atoms, and the nodes of all scopes by parent and atom. the
+// table keeps a reference to each node, so a scope made again on the next
+// line finds its node. nodes only the table refers to are swept when a
+// shard grows large. sharded to keep threads parsing at once apart
+struct scope_t::table_t {
+    static table_t& instance()
+    {
+        // never freed, scopes may be released by other statics at exit
+        static table_t* res = new table_t();
+        return *res;
+    }
+
+    std::string const* intern(std::string const& atom)
+    {
+        atom_shard_t& shard = atom_shards[std::hash<std::string>()(atom) % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return &*shard.atoms.insert(atom).first;
+    }
+
+    // takes over the reference to parent
+    node_t* push(std::string const& atom, node_t* parent)
+    {
+        key_t key = { parent, &atom };
+        node_shard_t& shard = node_shards[key_hash_t()(key) % kShards];
+
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.nodes.find(key);
+        if (it != shard.nodes.end()) {
+            node_t* res = it->second;
+            res->retain();
+            lock.unlock();
+            if (parent)
+                parent->release();
+            return res;
+        }
+
+        if (shard.nodes.size() >= shard.sweep_at)
+            sweep(shard);
+
+        node_t* res = new node_t(intern(atom), parent);
+        res->retain();
+        shard.nodes.emplace(key_t{ parent, res->_atoms }, res);
+        return res;
+    }
+
+private:
+    static size_t const kShards = 16;
+    static size_t const kSweepAt = 4096;
+
+    // keys in the table point to interned atoms, lookups to any string
+    struct key_t {
+        node_t const* parent;
+        std::string const* atom;
+        bool operator==(key_t const& rhs) const
+        {
+            return parent == rhs.parent && (atom == rhs.atom || *atom == *rhs.atom);
+        }
+    };
+
+    struct key_hash_t {
+        size_t operator()(key_t const& key) const
+        {
+            return hash_combine(std::hash<node_t const*>()(key.parent),
+                std::hash<std::string>()(*key.atom));
+        }
+    };
+
+    struct atom_shard_t {
+        std::mutex mutex;
+        std::unordered_set<std::string> atoms;
+    };
+
+    struct node_shard_t {
+        node_shard_t()
+            : sweep_at(kSweepAt)
+        {
+        }
+
+        std::mutex mutex;
+        std::unordered_map<key_t, node_t*, key_hash_t> nodes;
+        size_t sweep_at;
+    };
+
+    // drops nodes no scope refers to. new references are only made from
+    // existing ones or under the shard lock, so such a node stays unused
+    static void sweep(node_shard_t& shard)
+    {
+        for (auto it = shard.nodes.begin(); it != shard.nodes.end();) {
+            if (it->second->_retain_count == 1) {
+                it->second->release();
+                it = shard.nodes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        size_t live = shard.nodes.size();
+        shard.sweep_at = live * 2 > kSweepAt ? live * 2 : kSweepAt;
+    }
+
+    atom_shard_t atom_shards[kShards];
+    node_shard_t node_shards[kShards];
+};
+
 // ===================
 // = scope_t::node_t =
 // ===================
 
-scope_t::node_t::node_t(std::string const& atoms, node_t* parent)
+scope_t::node_t::node_t(std::string const* atoms, node_t* parent)
     : _atoms(atoms)
     , _parent(parent)
     , _retain_count(1)
-    , _hash(std::hash<std::string>()(atoms) ^ (parent ? parent->_hash : 0))
+    , _hash(parent ? hash_combine(parent->_hash, std::hash<std::string>()(*atoms)) : std::hash<std::string>()(*atoms))
+    , _number_of_atoms(std::count(atoms->begin(), atoms->end(), '.') + 1)
 {
 }
 
@@ -69,12 +186,7 @@ bool scope_t::node_t::is_auxiliary_scope() const
     return strncmp(c_str(), "attr.", 5) == 0 || strncmp(c_str(), "dyn.", 4) == 0;
 }
 
-size_t scope_t::node_t::number_of_atoms() const
-{
-    return std::count(_atoms.begin(), _atoms.end(), '.') + 1;
-}
-
-char const* scope_t::node_t::c_str() const { return _atoms.c_str(); }
+char const* scope_t::node_t::c_str() const { return _atoms->c_str(); }
 
 // =========
 // = Scope =
@@ -142,7 +254,17 @@ bool scope_t::has_prefix(scope_t const& rhs) const
 
 void scope_t::push_scope(std::string const& atom)
 {
-    node = new node_t(atom, node);
+    node = table_t::instance().push(atom, node);
+}
+
+void scope_t::push_scope(atom_t atom)
+{
+    node = table_t::instance().push(*atom, node);
+}
+
+atom_t scope_t::intern(std::string const& atom)
+{
+    return table_t::instance().intern(atom);
 }
 
 void scope_t::pop_scope()
@@ -157,7 +279,7 @@ void scope_t::pop_scope()
 std::string const& scope_t::back() const
 {
     // ASSERT(node);
-    return node->_atoms;
+    return *node->_atoms;
 }
 
 size_t scope_t::size() const
@@ -173,15 +295,7 @@ size_t scope_t::size() const
 
 bool scope_t::empty() const { return !node; }
 
-bool scope_t::operator==(scope_t const& rhs) const
-{
-    auto n1 = node, n2 = rhs.node;
-    while (n1 != n2 && n1 && n2 && n1->_atoms == n2->_atoms) {
-        n1 = n1->parent();
-        n2 = n2->parent();
-    }
-    return n1 == n2;
-}
+bool scope_t::operator==(scope_t const& rhs) const { return node == rhs.node; }
 
 bool scope_t::operator<(scope_t const& rhs) const
 {
@@ -190,7 +304,7 @@ bool scope_t::operator<(scope_t const& rhs) const
         n1 = n1->parent();
         n2 = n2->parent();
     }
-    return (!n1 && n2) || (n1 && n2 && n1->_atoms < n2->_atoms);
+    return (!n1 && n2) || (n1 && n2 && *n1->_atoms < *n2->_atoms);
 }
 
 bool scope_t::operator!=(scope_t const& rhs) const { return !(*this == rhs); }
@@ -243,7 +357,7 @@ void scope_t::to_s_helper(scope_t::node_t* n, std::string& out) const
         to_s_helper(p, out);
         out.append(1, ' ');
     }
-    out.append(n->_atoms);
+    out.append(*n->_atoms);
 }
 
 scope_t::operator std::string() const
@@ -1,6 +1,7 @@
 #ifndef SCOPES_SCOPE_H
 #define SCOPES_SCOPE_H
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <string>
@@ -13,6 +14,9 @@ namespace types {
 
 } // namespace types
 
+// an interned atom, equal atoms are the same string
+typedef std::string const* atom_t;
+
 struct scope_t {
     // WATCH_LEAKS(scope_t);
 
@@ -29,6 +33,7 @@ struct scope_t {
     bool has_prefix(scope_t const& rhs) const;
 
     void push_scope(std::string const& atom);
+    void push_scope(atom_t atom);
     void pop_scope();
     std::string const& back() const;
     size_t size() const;
@@ -42,30 +47,40 @@ struct scope_t {
     explicit operator bool() const;
     explicit operator std::string() const;
 
+    // back() of a scope is interned, &back() equals the atom pushed
+    static atom_t intern(std::string const& atom);
+
+    // the shared node, equal scopes have the same one while either is alive
+    void const* node_id() const { return node; }
+
 private:
+    // nodes are shared, equal scopes have the same node
     struct node_t {
         // WATCH_LEAKS(scope_t::node_t);
 
-        node_t(std::string const& atoms, node_t* parent);
+        node_t(std::string const* atoms, node_t* parent);
         ~node_t();
 
         void retain();
         void release();
 
         bool is_auxiliary_scope() const;
-        size_t number_of_atoms() const;
+        size_t number_of_atoms() const { return _number_of_atoms; }
         char const* c_str() const;
         node_t* parent() const { return _parent; }
 
     private:
         friend scope_t;
         friend scope_t shared_prefix(scope_t const& lhs, scope_t const& rhs);
-        std::string _atoms;
+        std::string const* _atoms; // interned, equal atoms are the same string
         node_t* _parent;
-        size_t _retain_count;
+        std::atomic<size_t> _retain_count;
         size_t _hash;
+        size_t _number_of_atoms;
     };
 
+    struct table_t;
+
     explicit scope_t(node_t* node);
     void setup(std::string const& str);
     void to_s_helper(scope_t::node_t* n, std::string& out) const;
@@ -7,66 +7,27 @@
 #include "textmate.h"
 
 #include <time.h>
-#define SKIP_PARSE_THRESHOLD 500
-
+#define LONG_LINE_THRESHOLD 500
+#define LINE_MEMO_SIZE 4096
+#define CHECKPOINT_LINE_LENGTH 128
+#define CHECKPOINT_STEP 32
+#define CHECKPOINT_MARGIN 32
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <list>
+#include <mutex>
 #include <string>
-
-#define MAX_STYLED_SPANS 512
-#define MAX_BUFFER_LENGTH (1024 * 4)
+#include <unordered_map>
 
 inline bool color_is_set(rgba_t clr) {
   return clr.r >= 0 && (clr.r != 0 || clr.g != 0 || clr.b != 0 || clr.a != 0);
 }
 
-inline textstyle_t construct_style(std::vector<span_info_t> &spans, int16_t index) {
-  textstyle_t res = {
-      index, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, false, false, false, false,
-  };
-
-  memset(&res, 0, sizeof(textstyle_t));
-  res.start = index;
-  res.length = 1;
-
-  // int16_t start;
-  // int16_t length;
-  // int16_t flags;
-  // int16_t r;
-  // int16_t g;
-  // int16_t b;
-  // int16_t a;
-  // int16_t bg_r;
-  // int16_t bg_g;
-  // int16_t bg_b;
-  // int16_t bg_a;
-  // int8_t caret;
-  // bool bold;
-  // bool italic;
-  // bool underline;
-  // bool strike;
-
-  for (auto span : spans) {
-    if (index >= span.start && index < span.start + span.length) {
-      if (!color_is_set({res.r, res.g, res.b, 0}) && color_is_set(span.fg)) {
-        res.r = span.fg.r;
-        res.g = span.fg.g;
-        res.b = span.fg.b;
-        res.a = span.fg.a;
-      }
-      res.italic = res.italic || span.italic;
-
-      if (span.scope.find("comment.block") == 0) {
-        res.flags = res.flags | SCOPE_COMMENT_BLOCK;
-      }
-      if (span.scope.find("string.quoted") == 0) {
-        res.flags = res.flags | SCOPE_STRING;
-      }
-    }
-  }
-  return res;
-}
-
-inline bool textstyles_equal(textstyle_t &first, textstyle_t &second) {
+inline bool textstyles_equal(textstyle_t const &first,
+                             textstyle_t const &second) {
   return first.italic == second.italic && first.bold == second.bold &&
         first.strike == second.strike && first.underline == second.underline &&
          first.r == second.r &&
@@ -81,20 +42,166 @@ inline bool textstyles_equal(textstyle_t &first, textstyle_t &second) {
          first.flags == second.flags;
 }
 
+static void fallback_foreground(textstyle_t &style, theme_info_t &info) {
+  if (!color_is_set({style.r, style.g, style.b, 0})) {
+    if (style.r + style.g + style.b == 0) {
+      style.r = info.fg_r;
+      style.g = info.fg_g;
+      style.b = info.fg_b;
+      style.a = info.fg_a;
+    }
+  }
+}
+
+static theme_info_t compute_theme_info(theme_ptr theme);
+
+compiled_theme_t::compiled_theme_t(theme_ptr theme)
+    : theme(theme), info(compute_theme_info(theme)) {
+  memset(&blank, 0, sizeof(textstyle_t));
+  fallback_foreground(blank, info);
+}
+
+scope_style_t const &
+compiled_theme_t::style_for_scope(scope::scope_t const &scope) {
+  std::shared_ptr<style_index_t const> index = std::atomic_load(&_index);
+  if (index) {
+    auto it = index->find(scope.node_id());
+    if (it != index->end()) {
+      return *it->second;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  index = std::atomic_load(&_index);
+  if (index) {
+    auto it = index->find(scope.node_id());
+    if (it != index->end()) {
+      return *it->second;
+    }
+  }
+
+  style_t const &style = theme->styles_for_scope(scope);
+
+  scope_style_t res;
+  res.fg = {(int16_t)(255 * style.foreground.red),
+            (int16_t)(255 * style.foreground.green),
+            (int16_t)(255 * style.foreground.blue),
+            (int16_t)style.foreground.index};
+  res.bold = style.bold == bool_true;
+  res.italic = style.italic == bool_true;
+  res.underline = style.underlined == bool_true;
+
+  memset(&res.style, 0, sizeof(textstyle_t));
+  if (color_is_set(res.fg)) {
+    res.style.r = res.fg.r;
+    res.style.g = res.fg.g;
+    res.style.b = res.fg.b;
+    res.style.a = res.fg.a;
+  }
+  fallback_foreground(res.style, info);
+  res.style.italic = res.italic;
+
+  std::string const &name = scope.back();
+  if (name.find("comment.block") == 0) {
+    res.style.flags = res.style.flags | SCOPE_COMMENT_BLOCK;
+  }
+  if (name.find("string.quoted") == 0) {
+    res.style.flags = res.style.flags | SCOPE_STRING;
+  }
+
+  _styles.emplace_back(scope, res);
+  std::shared_ptr<style_index_t> next =
+      index ? std::make_shared<style_index_t>(*index)
+            : std::make_shared<style_index_t>();
+  next->emplace(scope.node_id(), &_styles.back().second);
+  std::atomic_store(&_index, std::shared_ptr<style_index_t const>(next));
+  return _styles.back().second;
+}
+
+static void push_run(std::vector<textstyle_t> &textstyles,
+                     textstyle_t const &style, size_t start, size_t end) {
+  if (start >= end) {
+    return;
+  }
+
+  if (textstyles.size() > 0 && textstyles_equal(style, textstyles.back())) {
+    textstyles.back().length += end - start;
+    return;
+  }
+
+  textstyles.push_back(style);
+  textstyles.back().start = start;
+  textstyles.back().length = end - start;
+}
+
+void textstyles_from_scopes(parse::scope_runs_t const &scopes,
+                            size_t length, compiled_theme_t &theme,
+                            std::vector<textstyle_t> &textstyles,
+                            std::vector<span_info_t> *span_infos,
+                            size_t from) {
+  // characters before the first scope
+  size_t first = scopes.size() > 0 ? scopes.begin()->first : length;
+  push_run(textstyles, theme.blank, from, first);
+
+  parse::scope_runs_t::const_iterator it = scopes.begin();
+  while (it != scopes.end()) {
+    size_t start = it->first;
+    scope::scope_t const &scope = it->second;
+    it++;
+    size_t end = it != scopes.end() ? it->first : length;
+
+    scope_style_t const &style = theme.style_for_scope(scope);
+
+    push_run(textstyles, style.style, start, end);
+
+    if (span_infos) {
+      span_info_t span = {.start = (int32_t)start,
+                          .length = (int32_t)(end - start),
+                          .fg = style.fg,
+                          .bg = {0, 0, 0, 0},
+                          .bold = style.bold,
+                          .italic = style.italic,
+                          .underline = style.underline,
+                          .scope = scope.back()};
+      span_infos->push_back(span);
+    }
+  }
+}
+
+// registries only grow while loading, lookups copy the pointers out under
+// the lock so highlighting can run on other threads
+static std::mutex registry_mutex;
 static extension_list extensions;
 static std::vector<theme_ptr> themes;
+static std::vector<compiled_theme_ptr> compiled_themes;
+static std::unordered_map<theme_t const *, compiled_theme_ptr>
+    compiled_by_theme; // also themes not loaded here, see compiled_theme
 static icon_theme_ptr icons;
 static std::vector<language_info_ptr> languages;
 
-static textstyle_t textstyle_buffer[MAX_STYLED_SPANS];
-static char text_buffer[MAX_BUFFER_LENGTH];
+static thread_local std::string text_buffer;
 
-int current_theme_id = 0;
-theme_ptr current_theme() { return themes[current_theme_id]; }
-theme_ptr Textmate::theme() { return themes[current_theme_id]; }
+std::atomic<int> current_theme_id(0);
+theme_ptr current_theme() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  return themes[current_theme_id];
+}
+theme_ptr Textmate::theme() { return current_theme(); }
 
-int current_language_id = 0;
-language_info_ptr Textmate::language() { return languages[current_language_id]; }
+// ids not returned by load_theme fall back to the current theme
+theme_ptr Textmate::theme(int id) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  if (id >= 0 && (size_t)id < themes.size()) {
+    return themes[id];
+  }
+  return themes[current_theme_id];
+}
+
+std::atomic<int> current_language_id(0);
+language_info_ptr Textmate::language() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  return languages[current_language_id];
+}
 
 void Textmate::initialize(std::string path) {
   load_extensions(path, extensions);
@@ -103,10 +210,10 @@ void Textmate::initialize(std::string path) {
   // }
 }
 
-rgba_t theme_color_from_scope_fg_bg(char *scope, bool fore) {
+static rgba_t scope_color(theme_ptr theme, char *scope, bool fore) {
   rgba_t res = {-1, 0, 0, 0};
-  if (current_theme()) {
-    style_t scoped = current_theme()->styles_for_scope(scope);
+  if (theme) {
+    style_t scoped = theme->styles_for_scope(scope);
     color_info_t sclr = scoped.foreground;
     if (!fore) {
       sclr = scoped.background;
@@ -116,13 +223,13 @@ rgba_t theme_color_from_scope_fg_bg(char *scope, bool fore) {
     res.b = sclr.blue * 255;
     if (sclr.red == -1) {
       color_info_t clr;
-      current_theme()->theme_color(scope, clr);
+      theme->theme_color(scope, clr);
       if (clr.red == -1) {
-        current_theme()->theme_color(
+        theme->theme_color(
             fore ? "editor.foreground" : "editor.background", clr);
       }
       if (clr.red == -1) {
-        current_theme()->theme_color(fore ? "foreground" : "background", clr);
+        theme->theme_color(fore ? "foreground" : "background", clr);
       }
       clr.red *= 255;
       clr.green *= 255;
@@ -135,10 +242,11 @@ rgba_t theme_color_from_scope_fg_bg(char *scope, bool fore) {
   return res;
 }
 
-rgba_t theme_color(char *scope) { return theme_color_from_scope_fg_bg(scope); }
+rgba_t theme_color_from_scope_fg_bg(char *scope, bool fore) {
+  return scope_color(current_theme(), scope, fore);
+}
 
-theme_info_t themeInfo;
-int themeInfoId = -1;
+rgba_t theme_color(char *scope) { return theme_color_from_scope_fg_bg(scope); }
 
 int Textmate::set_theme(int id)
 {
@@ -146,17 +254,57 @@ int Textmate::set_theme(int id)
   return id;
 }
 
-theme_info_t Textmate::theme_info() {
+theme_info_t Textmate::theme_info() { return compiled_theme()->info; }
+
+// lines are highlighted one call at a time, mostly with the theme of the
+// call before on the same thread. that one is kept to skip the lock.
+// themes not from load_theme are compiled on first use and kept
+compiled_theme_ptr Textmate::compiled_theme(theme_ptr theme) {
+  static thread_local theme_ptr last_theme;
+  static thread_local compiled_theme_ptr last_compiled;
+  if (theme != NULL && theme == last_theme) {
+    return last_compiled;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (theme == NULL) {
+      int id = current_theme_id;
+      if (id >= 0 && (size_t)id < compiled_themes.size()) {
+        return compiled_themes[id];
+      }
+    } else {
+      auto it = compiled_by_theme.find(theme.get());
+      if (it != compiled_by_theme.end()) {
+        last_theme = theme;
+        last_compiled = it->second;
+        return it->second;
+      }
+    }
+  }
+
+  compiled_theme_ptr compiled = std::make_shared<compiled_theme_t>(theme);
+  if (theme == NULL) {
+    return compiled;
+  }
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  compiled = compiled_by_theme.emplace(theme.get(), compiled).first->second;
+  last_theme = theme;
+  last_compiled = compiled;
+  return compiled;
+}
+
+static theme_info_t compute_theme_info(theme_ptr theme) {
   char _default[32] = "default";
   theme_info_t info;
   color_info_t fg;
-  if (current_theme()) {
-    current_theme()->theme_color("editor.foreground", fg);
+  if (theme) {
+    theme->theme_color("editor.foreground", fg);
     if (fg.is_blank()) {
-      current_theme()->theme_color("foreground", fg);
+      theme->theme_color("foreground", fg);
     }
     if (fg.is_blank()) {
-      rgba_t tc = theme_color_from_scope_fg_bg(_default);
+      rgba_t tc = scope_color(theme, _default, true);
       fg.red = (float)tc.r / 255;
       fg.green = (float)tc.g / 255;
       fg.blue = (float)tc.b / 255;
@@ -168,13 +316,13 @@ theme_info_t Textmate::theme_info() {
   fg.blue *= 255;
 
   color_info_t bg;
-  if (current_theme()) {
-    current_theme()->theme_color("editor.background", bg);
+  if (theme) {
+    theme->theme_color("editor.background", bg);
     if (bg.is_blank()) {
-      current_theme()->theme_color("background", bg);
+      theme->theme_color("background", bg);
     }
     if (bg.is_blank()) {
-      rgba_t tc = theme_color_from_scope_fg_bg(_default, false);
+      rgba_t tc = scope_color(theme, _default, false);
       bg.red = (float)tc.r / 255;
       bg.green = (float)tc.g / 255;
       bg.blue = (float)tc.b / 255;
@@ -186,22 +334,22 @@ theme_info_t Textmate::theme_info() {
   bg.blue *= 255;
 
   color_info_t sel;
-  if (current_theme())
-    current_theme()->theme_color("editor.selectionBackground", sel);
+  if (theme)
+    theme->theme_color("editor.selectionBackground", sel);
   sel.red *= 255;
   sel.green *= 255;
   sel.blue *= 255;
 
   color_info_t cmt;
-  if (current_theme()) {
-    // current_theme()->theme_color("comment", cmt);
-    style_t style = current_theme()->styles_for_scope("comment");
+  if (theme) {
+    // theme->theme_color("comment", cmt);
+    style_t style = theme->styles_for_scope("comment");
     cmt = style.foreground;
     if (cmt.is_blank()) {
-      current_theme()->theme_color("editor.foreground", cmt);
+      theme->theme_color("editor.foreground", cmt);
     }
     if (cmt.is_blank()) {
-      rgba_t tc = theme_color_from_scope_fg_bg(_default, false);
+      rgba_t tc = scope_color(theme, _default, false);
       cmt.red = (float)tc.r / 255;
       cmt.green = (float)tc.g / 255;
       cmt.blue = (float)tc.b / 255;
@@ -214,15 +362,15 @@ theme_info_t Textmate::theme_info() {
 
 
   color_info_t fn;
-  if (current_theme()) {
-    // current_theme()->theme_color("comment", fn);
-    style_t style = current_theme()->styles_for_scope("entity.name.function");
+  if (theme) {
+    // theme->theme_color("comment", fn);
+    style_t style = theme->styles_for_scope("entity.name.function");
     fn = style.foreground;
     if (fn.is_blank()) {
-      current_theme()->theme_color("editor.foreground", fn);
+      theme->theme_color("editor.foreground", fn);
     }
     if (fn.is_blank()) {
-      rgba_t tc = theme_color_from_scope_fg_bg(_default, false);
+      rgba_t tc = scope_color(theme, _default, false);
       fn.red = (float)tc.r / 255;
       fn.green = (float)tc.g / 255;
       fn.blue = (float)tc.b / 255;
@@ -234,15 +382,15 @@ theme_info_t Textmate::theme_info() {
   fn.blue *= 255;
 
   color_info_t kw;
-  if (current_theme()) {
-    // current_theme()->theme_color("comment", kw);
-    style_t style = current_theme()->styles_for_scope("keyword");
+  if (theme) {
+    // theme->theme_color("comment", kw);
+    style_t style = theme->styles_for_scope("keyword");
     kw = style.foreground;
     if (kw.is_blank()) {
-      current_theme()->theme_color("editor.foreground", kw);
+      theme->theme_color("editor.foreground", kw);
     }
     if (kw.is_blank()) {
-      rgba_t tc = theme_color_from_scope_fg_bg(_default, false);
+      rgba_t tc = scope_color(theme, _default, false);
       kw.red = (float)tc.r / 255;
       kw.green = (float)tc.g / 255;
       kw.blue = (float)tc.b / 255;
@@ -254,15 +402,15 @@ theme_info_t Textmate::theme_info() {
   kw.blue *= 255;
 
   color_info_t var;
-  if (current_theme()) {
-    // current_theme()->theme_color("comment", var);
-    style_t style = current_theme()->styles_for_scope("variable");
+  if (theme) {
+    // theme->theme_color("comment", var);
+    style_t style = theme->styles_for_scope("variable");
     var = style.foreground;
     if (var.is_blank()) {
-      current_theme()->theme_color("editor.foreground", var);
+      theme->theme_color("editor.foreground", var);
     }
     if (var.is_blank()) {
-      rgba_t tc = theme_color_from_scope_fg_bg(_default, false);
+      rgba_t tc = scope_color(theme, _default, false);
       var.red = (float)tc.r / 255;
       var.green = (float)tc.g / 255;
       var.blue = (float)tc.b / 255;
@@ -315,23 +463,32 @@ theme_info_t Textmate::theme_info() {
 int Textmate::load_theme(std::string path) {
   theme_ptr theme = theme_from_name(path, extensions);
   if (theme != NULL) {
+    compiled_theme_ptr compiled = std::make_shared<compiled_theme_t>(theme);
+    std::lock_guard<std::mutex> lock(registry_mutex);
     #ifdef DISABLE_RESOURCE_CACHING
     themes.clear();
+    compiled_themes.clear();
+    compiled_by_theme.clear();
     #endif
     themes.emplace_back(theme);
+    compiled_themes.emplace_back(compiled);
+    compiled_by_theme[theme.get()] = compiled;
     return themes.size() - 1;
   }
   return 0;
 }
 
 int Textmate::load_icons(std::string path) {
-  icons = icon_theme_from_name(path, extensions);
+  icon_theme_ptr icon_theme = icon_theme_from_name(path, extensions);
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  icons = icon_theme;
   return 0;
 }
 
 int Textmate::load_language(std::string path) {
   language_info_ptr lang = language_from_file(path, extensions);
   if (lang != NULL) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
     #ifdef DISABLE_RESOURCE_CACHING
     languages.clear();
     #endif
@@ -351,10 +508,16 @@ int Textmate::load_theme_data(const char* data)
 {
   theme_ptr theme = theme_from_name("", extensions, "", data);
   if (theme != NULL) {
+    compiled_theme_ptr compiled = std::make_shared<compiled_theme_t>(theme);
+    std::lock_guard<std::mutex> lock(registry_mutex);
     #ifdef DISABLE_RESOURCE_CACHING
     themes.clear();
+    compiled_themes.clear();
+    compiled_by_theme.clear();
     #endif
     themes.emplace_back(theme);
+    compiled_themes.emplace_back(compiled);
+    compiled_by_theme[theme.get()] = compiled;
     return themes.size() - 1;
   }
   return 0;
@@ -364,6 +527,7 @@ int Textmate::load_language_data(const char* data)
 {
   language_info_ptr lang = language_from_file("", extensions, data);
   if (lang != NULL) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
     #ifdef DISABLE_RESOURCE_CACHING
     languages.clear();
     #endif
@@ -373,52 +537,263 @@ int Textmate::load_language_data(const char* data)
   return 0;
 }
 
-language_info_ptr Textmate::language_info(int id) { return languages[id]; }
-
-void dump_tokens(std::map<size_t, scope::scope_t> &scopes) {
-  std::map<size_t, scope::scope_t>::iterator it = scopes.begin();
-  while (it != scopes.end()) {
-    size_t n = it->first;
-    scope::scope_t scope = it->second;
-    std::cout << n << " size:" << scope.size()
-              << " atoms:" << to_s(scope).c_str() << std::endl;
-
-    it++;
-  }
+language_info_ptr Textmate::language_info(int id) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  return languages[id];
 }
 
-block_data_t _previous_block_data;
+thread_local block_data_t _previous_block_data;
+
+// scopes of the line being highlighted, reused from line to line
+static thread_local parse::scope_runs_t scope_runs;
 block_data_t* Textmate::previous_block_data()
 {
   return &_previous_block_data;
 }
 
-std::vector<textstyle_t>
-Textmate::run_highlighter(char *_text, language_info_ptr lang, theme_ptr theme,
-                          block_data_t *block, block_data_t *prev_block,
-                          block_data_t *next_block, std::vector<span_info_t> *span_infos) {
+typedef std::shared_ptr<parse::scope_runs_t const> scope_runs_ptr;
+
+// lines parsed before, by grammar, text and the state they start in. files
+// with many identical lines (generated code, logs, csv, lock files) parse
+// each distinct line in each state once. the least recently used are
+// dropped past LINE_MEMO_SIZE
+class line_memo_t {
+public:
+  struct entry_t {
+    parse::grammar_ptr grammar;
+    parse::stack_ptr start_state;
+    std::string text;
+    parse::stack_ptr end_state;
+    scope_runs_ptr runs;
+  };
 
-  std::vector<textstyle_t> textstyle_buffer;
+  bool find(parse::grammar_ptr const &grammar,
+            parse::stack_ptr const &start_state, std::string const &text,
+            size_t text_hash, entry_t &res) {
+    size_t hash = key_hash(grammar, start_state, text_hash);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _lookups++;
+    auto range = _index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      entry_t const &entry = *it->second;
+      if (entry.grammar == grammar && entry.start_state == start_state &&
+          entry.text == text) {
+        _entries.splice(_entries.begin(), _entries, it->second);
+        _hits++;
+        res = entry;
+        return true;
+      }
+    }
+    return false;
+  }
 
-  if (strlen(_text) > SKIP_PARSE_THRESHOLD) {
-    return textstyle_buffer;
+  void insert(entry_t entry, size_t text_hash) {
+    size_t hash = key_hash(entry.grammar, entry.start_state, text_hash);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.push_front(std::move(entry));
+    _index.emplace(hash, _entries.begin());
+    if (_entries.size() > LINE_MEMO_SIZE) {
+      entry_t const &last = _entries.back();
+      auto range = _index.equal_range(key_hash(
+          last.grammar, last.start_state, std::hash<std::string>()(last.text)));
+      for (auto it = range.first; it != range.second; ++it) {
+        if (&*it->second == &last) {
+          _index.erase(it);
+          break;
+        }
+      }
+      _entries.pop_back();
+    }
   }
 
-  // printf("hl %x %s\n", block, _text);
+  line_memo_stats_t stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    line_memo_stats_t res = {_lookups, _hits, _entries.size()};
+    return res;
+  }
 
-  parse::grammar_ptr gm = lang->grammar;
-  themeInfo = theme_info();
+private:
+  typedef std::list<entry_t> entries_t;
 
-  std::map<size_t, scope::scope_t> scopes;
+  static size_t key_hash(parse::grammar_ptr const &grammar,
+                         parse::stack_ptr const &start_state,
+                         size_t text_hash) {
+    size_t res = std::hash<parse::grammar_t *>()(grammar.get());
+    res ^= std::hash<parse::stack_t *>()(start_state.get()) + 0x9e3779b9 +
+           (res << 6) + (res >> 2);
+    return res ^ (text_hash + 0x9e3779b9 + (res << 6) + (res >> 2));
+  }
 
-  std::string str = _text;
-  str += "\n";
+  std::mutex _mutex;
+  entries_t _entries; // most recently used first
+  std::unordered_multimap<size_t, entries_t::iterator> _index;
+  size_t _lookups = 0;
+  size_t _hits = 0;
+};
 
-  const char *text = str.c_str();
+static line_memo_t line_memo;
 
-  size_t l = str.length();
-  const char *first = text;
-  const char *last = first + l;
+line_memo_stats_t Textmate::line_memo_stats() { return line_memo.stats(); }
+
+// a state whose contexts all began before pos means the same at any later
+// position, as does one whose anchors were cleared at the end of a line
+static bool anchored_before(parse::stack_ptr const &state, size_t pos) {
+  for (parse::stack_t const *node = state.get(); node;
+       node = node->parent.get()) {
+    if (node->anchor >= pos && node->anchor != SIZE_MAX) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t runs_before(parse::scope_runs_t const &runs, size_t offset) {
+  return std::lower_bound(runs.begin(), runs.end(), offset,
+                          [](std::pair<size_t, scope::scope_t> const &lhs,
+                             size_t rhs) { return lhs.first < rhs; }) -
+         runs.begin();
+}
+
+static thread_local parse::scope_runs_t resumed_runs;
+
+// lines of CHECKPOINT_LINE_LENGTH bytes or more keep the states they pass
+// through, CHECKPOINT_STEP bytes or more apart. when the line is edited and
+// parsed again from the same start state (previous_end is where it ended
+// before), the parse resumes from the last checkpoint before the edit, and
+// stops at the first one after it with the same state as before. the rest
+// of the old runs are moved by the edit. checkpoints within
+// CHECKPOINT_MARGIN bytes of the edit are not used, patterns may look
+// around their match. a pattern looking further may see the line differently
+// than a whole parse would, so reused is set when the result was not parsed
+// from the start to the end
+static parse::stack_ptr parse_in_steps(std::string const &str,
+                                       parse::stack_ptr state, bool firstLine,
+                                       parse::stack_ptr const &previous_end,
+                                       line_tokens_t &tokens,
+                                       parse::scope_runs_t &runs,
+                                       bool &reused) {
+  const char *first = str.c_str();
+  const char *last = first + str.length();
+  size_t length = str.length();
+
+  std::vector<line_checkpoint_t> checkpoints;
+  size_t offset = 0;
+  runs.clear();
+
+  // the edit, by the bytes before and after it both texts share
+  std::string const &old = tokens.text;
+  bool edited = previous_end && tokens.runs && !tokens.checkpoints.empty();
+  size_t prefix = 0;
+  size_t suffix = 0;
+  if (edited) {
+    size_t shorter = old.length() < length ? old.length() : length;
+    while (prefix < shorter && old[prefix] == str[prefix]) {
+      prefix++;
+    }
+    while (suffix < shorter - prefix &&
+           old[old.length() - 1 - suffix] == str[length - 1 - suffix]) {
+      suffix++;
+    }
+
+    for (auto const &checkpoint : tokens.checkpoints) {
+      if (checkpoint.offset + CHECKPOINT_MARGIN > prefix) {
+        break;
+      }
+      checkpoints.push_back(checkpoint);
+    }
+    if (!checkpoints.empty()) {
+      line_checkpoint_t const &resume = checkpoints.back();
+      runs.assign(tokens.runs->begin(), tokens.runs->begin() + resume.run);
+      state = resume.state;
+      offset = resume.offset;
+      reused = true;
+    }
+  }
+
+  // past the edit, a checkpoint in the same state as before ends the line
+  // as before
+  std::vector<line_checkpoint_t>::const_iterator same = tokens.checkpoints.end();
+  parse::checkpoint_fn checkpoint = [&](size_t at,
+                                        parse::stack_ptr const &at_state) {
+    line_checkpoint_t added = {at, at_state, 0};
+    checkpoints.push_back(added);
+    if (!edited || at < length - suffix + CHECKPOINT_MARGIN) {
+      return false;
+    }
+    size_t old_at = at - length + old.length();
+    auto it = std::lower_bound(
+        tokens.checkpoints.begin(), tokens.checkpoints.end(), old_at,
+        [](line_checkpoint_t const &lhs, size_t rhs) {
+          return lhs.offset < rhs;
+        });
+    if (it != tokens.checkpoints.end() && it->offset == old_at &&
+        it->state == at_state) {
+      same = it;
+      return true;
+    }
+    return false;
+  };
+
+  state = parse::parse(first, last, state, resumed_runs, firstLine, offset,
+                       CHECKPOINT_STEP, checkpoint);
+
+  // a resumed parse begins with a run, even if the scope goes on
+  auto it = resumed_runs.begin();
+  if (it != resumed_runs.end() && !runs.empty() &&
+      runs.back().second == it->second) {
+    it++;
+  }
+  runs.insert(runs.end(), it, resumed_runs.end());
+
+  if (same != tokens.checkpoints.end()) {
+    runs.resize(runs_before(runs, offset));
+    for (size_t r = same->run; r < tokens.runs->size(); r++) {
+      auto const &run = (*tokens.runs)[r];
+      runs.emplace_back(run.first - old.length() + length, run.second);
+    }
+    // later checkpoints are kept while their states do not depend on where
+    for (auto later = same + 1; later != tokens.checkpoints.end(); later++) {
+      if (!anchored_before(later->state, prefix)) {
+        break;
+      }
+      line_checkpoint_t moved = {later->offset - old.length() + length,
+                                 later->state, 0};
+      checkpoints.push_back(moved);
+    }
+    state = previous_end;
+    reused = true;
+  }
+
+  for (auto &checkpoint : checkpoints) {
+    checkpoint.run = runs_before(runs, checkpoint.offset);
+  }
+  tokens.text = str;
+  tokens.checkpoints.swap(checkpoints);
+  return state;
+}
+
+// parse a single line, threading the parser state from the previous block
+// the line's scopes are left in block->tokens. a line whose text and start
+// state are those of its last parse is not parsed again
+// returns true if the state at the end of the line has changed
+static bool parse_block(std::string const &str, language_info_ptr lang,
+                        block_data_t *block, block_data_t *prev_block) {
+  parse::grammar_ptr gm = lang->grammar;
+
+  // rules change while included grammars load. the line is left unstyled
+  // and in no state, it is parsed again when highlighted after that
+  if (!gm->ready()) {
+    static std::shared_ptr<parse::scope_runs_t const> no_runs =
+        std::make_shared<parse::scope_runs_t>();
+    block->tokens = line_tokens_t();
+    block->tokens.runs = no_runs;
+    block->parser_state = NULL;
+    _previous_block_data.parser_state = NULL;
+    return false;
+  }
+
+  const char *first = str.c_str();
+  const char *last = first + str.length();
 
   parse::stack_ptr parser_state;
   if (prev_block != NULL) {
@@ -427,136 +802,388 @@ Textmate::run_highlighter(char *_text, language_info_ptr lang, theme_ptr theme,
     block->prev_string_block = prev_block->string_block;
   }
 
+  // states are interned, equal ones are the same pointer
+  line_tokens_t &tokens = block->tokens;
+  if (block->parser_state && tokens.grammar == gm &&
+      tokens.start_state == parser_state && tokens.text == str) {
+    _previous_block_data.parser_state = block->parser_state;
+    return false;
+  }
+
+  // an edited line may be parsed again from where the edit is
+  parse::stack_ptr previous_end;
+  if (tokens.grammar == gm && tokens.start_state == parser_state) {
+    previous_end = block->parser_state;
+  }
+
+  tokens.grammar = gm;
+  tokens.start_state = parser_state;
+
+  size_t text_hash = std::hash<std::string>()(str);
+  line_memo_t::entry_t memo;
+  if (line_memo.find(gm, tokens.start_state, str, text_hash, memo)) {
+    parser_state = memo.end_state;
+    tokens.runs = memo.runs;
+    tokens.text = str;
+    tokens.checkpoints.clear();
+  } else {
+    memo.grammar = gm;
+    memo.start_state = parser_state;
+    memo.text = str;
+
+    bool firstLine = false;
+    if (parser_state == NULL) {
+      parser_state = gm->seed();
+      firstLine = true;
+    }
+
+    // TIMER_BEGIN
+    bool reused = false;
+    if (str.length() >= CHECKPOINT_LINE_LENGTH) {
+      parser_state = parse_in_steps(str, parser_state, firstLine, previous_end,
+                                    tokens, scope_runs, reused);
+    } else {
+      parser_state =
+          parse::parse(first, last, parser_state, scope_runs, firstLine);
+      tokens.text = str;
+      tokens.checkpoints.clear();
+    }
+    // TIMER_END
+
+    // if ((cpu_time_used > 0.01)) {
+    // printf(">>%f %s", cpu_time_used, text);
+    // printf("%s\n", text);
+    // dump_tokens(scopes);
+    // }
+
+    // sized to fit, shared by the block and the memo
+    tokens.runs = std::make_shared<parse::scope_runs_t>(scope_runs);
+
+    // only whole parses are memoized
+    if (!reused) {
+      memo.end_state = parser_state;
+      memo.runs = tokens.runs;
+      line_memo.insert(std::move(memo), text_hash);
+    }
+  }
+
+  parse::stack_ptr previous_state = block->parser_state;
+  block->parser_state = parser_state;
+  _previous_block_data.parser_state = parser_state;
+
+  return !parse::equal(previous_state, parser_state);
+}
+
+// the end state of a long line, taken from its stepped parse when that is
+// done from the same start, else parsed whole. its scopes are left to the
+// stepped parse. returns true if the state has changed
+static bool parse_long_line(std::string const &text, language_info_ptr lang,
+                            block_data_t *block, block_data_t *prev_block) {
+  if (!lang->grammar->ready()) {
+    block->parser_state = NULL;
+    _previous_block_data.parser_state = NULL;
+    return false;
+  }
+
+  parse::stack_ptr start_state;
+  if (prev_block != NULL) {
+    start_state = prev_block->parser_state;
+  }
+
+  parse::stack_ptr state;
+  long_line_t const *progress = block->long_line.get();
+  if (progress && progress->state && progress->grammar == lang->grammar &&
+      progress->text == text + "\n" &&
+      progress->offset >= progress->text.length() &&
+      parse::equal(progress->start_state, start_state)) {
+    state = progress->state;
+  } else {
+    state = Textmate::parse_line(text, lang, start_state);
+  }
+
+  parse::stack_ptr previous_state = block->parser_state;
+  block->parser_state = state;
+  _previous_block_data.parser_state = state;
+
+  return !parse::equal(previous_state, state);
+}
+
+bool Textmate::run_parser(char *_text, language_info_ptr lang,
+                          block_data_t *block, block_data_t *prev_block) {
+  std::string str = _text;
+  if (str.length() > LONG_LINE_THRESHOLD) {
+    return parse_long_line(str, lang, block, prev_block);
+  }
+
+  str += "\n";
+
+  return parse_block(str, lang, block, prev_block);
+}
+
+// the state at the end of a line, parsed whole from the given state (NULL for
+// the first line), long lines are not cut. nothing is kept, lines parsed ahead of the view do not
+// take the place of visible ones in the memo
+parse::stack_ptr Textmate::parse_line(std::string const &text,
+                                      language_info_ptr lang,
+                                      parse::stack_ptr state) {
+  std::string str = text + "\n";
   bool firstLine = false;
-  if (parser_state == NULL) {
-    parser_state = gm->seed();
+  if (state == NULL) {
+    state = lang->grammar->seed();
     firstLine = true;
   }
+  size_t offset = 0;
+  return parse::parse(str.c_str(), str.c_str() + str.length(), state,
+                      scope_runs, firstLine, offset, str.length());
+}
 
-  // TIMER_BEGIN
-  parser_state = parse::parse(first, last, parser_state, scopes, firstLine);
-  // TIMER_END
+// long lines are parsed long_line_step bytes at a time, for at most
+// long_line_budget seconds of wall time per call. the next call resumes where it stopped
+static std::atomic<size_t> long_line_step(512);
+static std::atomic<double> long_line_budget(0.008);
 
-  // if ((cpu_time_used > 0.01)) {
-  // printf(">>%f %s", cpu_time_used, text);
-  // printf("%s\n", text);
-  // dump_tokens(scopes);
-  // }
+void Textmate::set_long_line_budget(size_t bytes, double milliseconds) {
+  if (bytes > 0) {
+    long_line_step = bytes;
+  }
+  if (milliseconds > 0) {
+    long_line_budget = milliseconds / 1000;
+  }
+}
 
-  block->parser_state = parser_state;
+void Textmate::set_grammar_cache(std::string path) {
+  parse::set_grammar_cache(path);
+}
 
-  std::map<size_t, scope::scope_t>::iterator it = scopes.begin();
-  size_t n = 0;
+bool Textmate::is_long_line_pending(block_data_t *block) {
+  return block && block->long_line &&
+         block->long_line->offset < block->long_line->text.length();
+}
 
-  std::vector<span_info_t> spans;
+// append the runs overlapping [from, to), cut to that range
+static void clip_textstyles(std::vector<textstyle_t> const &textstyles,
+                            size_t from, size_t to,
+                            std::vector<textstyle_t> &res) {
+  auto it = std::upper_bound(
+      textstyles.begin(), textstyles.end(), from,
+      [](size_t pos, textstyle_t const &t) {
+        return pos < (size_t)(t.start + t.length);
+      });
+  for (; it != textstyles.end() && (size_t)it->start < to; it++) {
+    textstyle_t t = *it;
+    size_t start = (size_t)t.start > from ? (size_t)t.start : from;
+    size_t end = (size_t)(t.start + t.length) < to ? (size_t)(t.start + t.length) : to;
+    t.start = start;
+    t.length = end - start;
+    res.push_back(t);
+  }
+}
 
-  while (it != scopes.end()) {
-    n = it->first;
-    scope::scope_t scope = it->second;
-    std::string scopeName(scope);
-    style_t style = theme->styles_for_scope(scopeName);
-
-    scopeName = scope.back();
-    // printf(">%s %d\n", scopeName.c_str());
-
-    span_info_t span = {.start = (int16_t)n,
-                        .length = (int16_t)(l - n),
-                        .fg =
-                            {
-                                (int16_t)(255 * style.foreground.red),
-                                (int16_t)(255 * style.foreground.green),
-                                (int16_t)(255 * style.foreground.blue),
-                                (int16_t)style.foreground.index,
-                            },
-                        .bg = {0, 0, 0, 0},
-                        .bold = style.bold == bool_true,
-                        .italic = style.italic == bool_true,
-                        .underline = style.underlined == bool_true,
-                        // .state = state,
-                        .scope = scopeName};
-
-    if (spans.size() > 0) {
-      span_info_t &prevSpan = spans.front();
-      prevSpan.length = n - prevSpan.start;
-    }
-
-    spans.push_back(span);
+// append the styles of the runs overlapping [from, to), cut to that range.
+// the last run ends at length
+static void style_runs(parse::scope_runs_t const &runs, size_t length,
+                       compiled_theme_t &theme, size_t from, size_t to,
+                       std::vector<textstyle_t> &res) {
+  auto it = std::upper_bound(
+      runs.begin(), runs.end(), from,
+      [](size_t pos, std::pair<size_t, scope::scope_t> const &run) {
+        return pos < run.first;
+      });
+  if (it != runs.begin()) {
+    it--;
+  }
+  while (it != runs.end() && it->first < to) {
+    size_t start = it->first > from ? it->first : from;
+    scope::scope_t const &scope = it->second;
     it++;
+    size_t end = it != runs.end() ? it->first : length;
+    push_run(res, theme.style_for_scope(scope).style, start,
+             end < to ? end : to);
   }
+}
 
-  {
-    span_info_t *prev = NULL;
-    for (auto &s : spans) {
-      if (prev) {
-        prev->length = s.start - prev->start;
-      }
-      prev = &s;
-    }
+static std::vector<textstyle_t>
+run_long_line(std::string const &str, language_info_ptr lang,
+              compiled_theme_t &theme, block_data_t *block,
+              block_data_t *prev_block, block_data_t *next_block, size_t from,
+              size_t to) {
+  parse::stack_ptr start_state;
+  if (prev_block != NULL) {
+    start_state = prev_block->parser_state;
+    block->prev_comment_block = prev_block->comment_block;
+    block->prev_string_block = prev_block->string_block;
   }
-    
-  if (span_infos) {
-    span_infos->clear();
-    for(auto &s : spans) {
-      span_infos->push_back(s);
-    }
+
+  if (!block->long_line) {
+    block->long_line = std::make_shared<long_line_t>();
   }
 
-  int idx = 0;
-  for (int i = 0; i < l && i < MAX_STYLED_SPANS; i++) {
-    textstyle_t _ts = construct_style(spans, i);
-    textstyle_t *prev = NULL;
-    if (textstyle_buffer.size() > 0) {
-      prev = &textstyle_buffer[textstyle_buffer.size()-1];
-    }
+  // start over if the line, its grammar or the state it starts in has changed
+  long_line_t &progress = *block->long_line;
+  if (progress.grammar != lang->grammar || progress.text != str ||
+      !progress.state || !parse::equal(progress.start_state, start_state)) {
+    progress.grammar = lang->grammar;
+    progress.text = str;
+    progress.start_state = start_state;
+    progress.state = start_state ? start_state : lang->grammar->seed();
+    progress.first_line = start_state == NULL;
+    progress.offset = 0;
+    progress.runs.clear();
+  }
 
-    if (!color_is_set({_ts.r, _ts.g, _ts.b, 0})) {
-      if (_ts.r + _ts.g + _ts.b == 0) {
-        _ts.r = themeInfo.fg_r;
-        _ts.g = themeInfo.fg_g;
-        _ts.b = themeInfo.fg_b;
-        _ts.a = themeInfo.fg_a;
-      }
+  char const *first = progress.text.c_str();
+  char const *last = first + progress.text.length();
+  size_t length = progress.text.length();
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while (progress.offset < length) {
+    size_t offset = progress.offset;
+    progress.state =
+        parse::parse(first, last, progress.state, scope_runs,
+                     progress.first_line, progress.offset,
+                     offset + long_line_step);
+    progress.runs.insert(progress.runs.end(), scope_runs.begin(),
+                         scope_runs.end());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (elapsed.count() > long_line_budget) {
+      break;
     }
+  }
 
-    if (prev != NULL && (textstyles_equal(_ts, *prev))) {
-      prev->length++;
-    } else {
-      textstyle_buffer.push_back(_ts);
+  std::vector<textstyle_t> res;
+  style_runs(progress.runs, progress.offset, theme, from, to, res);
+
+  if (progress.offset < length) {
+    // the visible part is not reached yet, style it from the last state
+    // until the parse catches up
+    size_t offset = from > progress.offset ? from : progress.offset;
+    if (offset < to) {
+      size_t preview_end = offset + long_line_step < to ? offset + long_line_step : to;
+      // states are interned, the parser copies what it changes
+      parse::parse(first, last, progress.state, scope_runs,
+                   progress.first_line, offset, preview_end);
+      style_runs(scope_runs, offset, theme, from, to, res);
     }
+    return res;
+  }
+
+  parse::stack_ptr previous_state = block->parser_state;
+  block->parser_state = progress.state;
+  block->tokens = line_tokens_t();
+
+  if (progress.runs.size() > 0) {
+    textstyle_t const &last_style =
+        theme.style_for_scope(progress.runs.back().second).style;
+    block->comment_block = (last_style.flags & SCOPE_COMMENT_BLOCK);
+    block->string_block = (last_style.flags & SCOPE_STRING);
+  }
+
+  if (next_block && !parse::equal(previous_state, progress.state)) {
+    next_block->make_dirty();
+  }
+
+  return res;
+}
+
+std::vector<textstyle_t> Textmate::run_highlighter_slice(
+    char *_text, language_info_ptr lang, theme_ptr theme, block_data_t *block,
+    block_data_t *prev_block, block_data_t *next_block, size_t from,
+    size_t to) {
+  if (strlen(_text) <= LONG_LINE_THRESHOLD) {
+    std::vector<textstyle_t> res;
+    clip_textstyles(
+        run_highlighter(_text, lang, theme, block, prev_block, next_block),
+        from, to, res);
+    return res;
+  }
+
+  // see parse_block
+  if (!lang->grammar->ready()) {
+    block->long_line = NULL;
+    block->parser_state = NULL;
+    _previous_block_data.parser_state = NULL;
+    return std::vector<textstyle_t>();
+  }
+
+  std::string str = _text;
+  str += "\n";
+
+  return run_long_line(str, lang, *compiled_theme(theme), block, prev_block,
+                       next_block, from, to);
+}
+
+std::vector<textstyle_t>
+Textmate::run_highlighter(char *_text, language_info_ptr lang, theme_ptr theme,
+                          block_data_t *block, block_data_t *prev_block,
+                          block_data_t *next_block, std::vector<span_info_t> *span_infos) {
+
+  std::vector<textstyle_t> textstyle_buffer;
+
+  if (strlen(_text) > LONG_LINE_THRESHOLD) {
+    return run_highlighter_slice(_text, lang, theme, block, prev_block,
+                                 next_block, 0, SIZE_MAX);
   }
 
-  idx = textstyle_buffer.size();
+  block->long_line = NULL;
+
+  // printf("hl %x %s\n", block, _text);
+
+  compiled_theme_ptr compiled = compiled_theme(theme);
+
+  std::string str = _text;
+  str += "\n";
+
+  size_t l = str.length();
+
+  bool state_changed = parse_block(str, lang, block, prev_block);
+
+  if (span_infos) {
+    span_infos->clear();
+  }
+  textstyles_from_scopes(*block->tokens.runs, l, *compiled, textstyle_buffer,
+                         span_infos);
+
+  int idx = textstyle_buffer.size();
   if (idx > 0) {
     block->comment_block =
         (textstyle_buffer[idx - 1].flags & SCOPE_COMMENT_BLOCK);
     block->string_block = (textstyle_buffer[idx - 1].flags & SCOPE_STRING);
   }
 
-  if (next_block) {
-    if (next_block->prev_string_block != block->string_block ||
-        next_block->prev_comment_block != block->comment_block) {
-      next_block->make_dirty();
-    }
+  // the next line needs re-highlighting only if the state it starts in
+  // has changed
+  if (next_block && state_changed) {
+    next_block->make_dirty();
   }
 
-  _previous_block_data.parser_state = parser_state;
   return textstyle_buffer;
 }
 
+// the returned text is valid until the next call on the same thread
 char* Textmate::language_definition(int langId) {
-  language_info_ptr lang = languages[langId];
+  language_info_ptr lang = language_info(langId);
   std::ostringstream ss;
   ss << lang->definition;
-  strcpy(text_buffer, ss.str().c_str());
-  return text_buffer;
+  text_buffer = ss.str();
+  return (char *)text_buffer.c_str();
 }
 
 char* Textmate::icon_for_filename(char *filename) {
-  icon_t icon = icon_for_file(icons, filename, extensions);
-  strcpy(text_buffer, icon.path.c_str());
-  return text_buffer;
+  icon_theme_ptr icon_theme;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    icon_theme = icons;
+  }
+  icon_t icon = icon_for_file(icon_theme, filename, extensions);
+  text_buffer = icon.path;
+  return (char *)text_buffer.c_str();
 }
 
 bool Textmate::has_running_threads() {
   return parse::grammar_t::running_threads > 0;
+}
+
+bool Textmate::is_language_ready(int id) {
+  language_info_ptr lang = language_info(id);
+  return !lang || !lang->grammar || lang->grammar->ready();
 }
\ No newline at end of file
@@ -3,7 +3,11 @@
 
 #include "theme.h"
 #include "parse.h"
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #define SCOPE_COMMENT (1 << 1)
@@ -25,6 +29,36 @@
 
 // class Block;
 
+struct long_line_t;
+typedef std::shared_ptr<long_line_t> long_line_ptr;
+
+// the state a line was in after a step of its parse, see parse_in_steps
+struct line_checkpoint_t {
+  size_t offset;
+  parse::stack_ptr state;
+  size_t run; // runs before offset
+};
+
+// the scopes of a line from its last parse, and what it was parsed from.
+// runs do not depend on the theme, a line whose text and start state are
+// unchanged is styled again without parsing
+struct line_tokens_t {
+  parse::grammar_ptr grammar;
+  parse::stack_ptr start_state;
+  std::string text;
+  std::shared_ptr<parse::scope_runs_t const> runs; // shared by equal lines
+
+  // kept for lines parsed in steps
+  std::vector<line_checkpoint_t> checkpoints;
+};
+
+// lookups of lines in the memo of parsed lines, see parse_block
+struct line_memo_stats_t {
+  size_t lookups;
+  size_t hits;
+  size_t entries;
+};
+
 struct block_data_t {
   block_data_t()
       : parser_state(nullptr), comment_block(false), prev_comment_block(false),
@@ -37,6 +71,12 @@ struct block_data_t {
   bool string_block;
   bool prev_string_block;
 
+  // set while a long line is being parsed over several calls
+  long_line_ptr long_line;
+
+  // kept from the last parse of a line shorter than LONG_LINE_THRESHOLD
+  line_tokens_t tokens;
+
   virtual void make_dirty() {}
 };
 
@@ -79,8 +119,8 @@ struct theme_info_t {
 };
 
 struct textstyle_t {
-  int16_t start;
-  int16_t length;
+  int32_t start;
+  int32_t length;
   int16_t flags;
   int16_t r;
   int16_t g;
@@ -98,8 +138,8 @@ struct textstyle_t {
 };
 
 struct span_info_t {
-  int16_t start;
-  int16_t length;
+  int32_t start;
+  int32_t length;
   rgba_t fg;
   rgba_t bg;
   bool bold;
@@ -108,6 +148,52 @@ struct span_info_t {
   std::string scope;
 };
 
+// where the parse of a long line stopped, and the scopes up to there. like
+// line_tokens_t the runs do not depend on the theme, they are styled when
+// the line is highlighted
+struct long_line_t {
+  long_line_t() : offset(0), first_line(false) {}
+
+  parse::grammar_ptr grammar;
+  std::string text;
+  parse::stack_ptr start_state;
+  parse::stack_ptr state;
+  size_t offset;
+  bool first_line;
+  parse::scope_runs_t runs;
+};
+
+// a scope resolved against a theme, style is copied as is into the runs
+struct scope_style_t {
+  textstyle_t style;
+  rgba_t fg;
+  bool bold;
+  bool italic;
+  bool underline;
+};
+
+// theme palette and scope styles, computed once per theme
+struct compiled_theme_t {
+  compiled_theme_t(theme_ptr theme);
+
+  scope_style_t const &style_for_scope(scope::scope_t const &scope);
+
+  theme_ptr theme;
+  theme_info_t info;
+  textstyle_t blank;
+
+private:
+  // styles are kept as long as the theme, each with its scope so the node
+  // it is indexed by stays alive. lookups read a snapshot of the index
+  // without locking, a miss copies it under the lock
+  typedef std::unordered_map<void const *, scope_style_t const *> style_index_t;
+  std::mutex _mutex;
+  std::deque<std::pair<scope::scope_t, scope_style_t>> _styles;
+  std::shared_ptr<style_index_t const> _index;
+};
+
+typedef std::shared_ptr<compiled_theme_t> compiled_theme_ptr;
+
 class Textmate {
 public:
   static void initialize(std::string path);
@@ -119,15 +205,31 @@ public:
   static language_info_ptr language_info(int id = 0);
   static language_info_ptr language();
   static int set_language(int id);
+  static bool run_parser(char *_text, language_info_ptr lang,
+                         block_data_t *block, block_data_t *prev = NULL);
+  static parse::stack_ptr parse_line(std::string const &text,
+                                     language_info_ptr lang,
+                                     parse::stack_ptr state);
   static std::vector<textstyle_t>
   run_highlighter(char *_text, language_info_ptr lang, theme_ptr theme,
                   block_data_t *block = NULL, block_data_t *prev = NULL,
                   block_data_t *next = NULL, std::vector<span_info_t> *span_infos = NULL);
+  static std::vector<textstyle_t>
+  run_highlighter_slice(char *_text, language_info_ptr lang, theme_ptr theme,
+                        block_data_t *block, block_data_t *prev,
+                        block_data_t *next, size_t from, size_t to);
+  static void set_long_line_budget(size_t bytes, double milliseconds);
+  static void set_grammar_cache(std::string path);
+  static bool is_long_line_pending(block_data_t *block);
   static block_data_t* previous_block_data();
   static theme_info_t theme_info();
   static theme_ptr theme();
+  static theme_ptr theme(int id);
+  static compiled_theme_ptr compiled_theme(theme_ptr theme = NULL);
   static int set_theme(int id);
   static bool has_running_threads();
+  static bool is_language_ready(int id);
+  static line_memo_stats_t line_memo_stats();
 
   static char* language_definition(int langId);
   static char* icon_for_filename(char *filename);
@@ -135,4 +237,11 @@ public:
 
 rgba_t theme_color_from_scope_fg_bg(char *scope, bool fore = true);
 
+// merge the scopes of a parsed line of the given length into styled runs
+void textstyles_from_scopes(parse::scope_runs_t const &scopes,
+                            size_t length, compiled_theme_t &theme,
+                            std::vector<textstyle_t> &textstyles,
+                            std::vector<span_info_t> *span_infos = NULL,
+                            size_t from = 0);
+
 #endif // TEXTMATE_H
\ No newline at end of file
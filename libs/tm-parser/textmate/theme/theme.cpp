@@ -330,9 +330,12 @@ style_t const& theme_t::styles_for_scope(scope::scope_t const& scope)
 {
     size_t hash = scope.hash();
 
-    auto styles = _cache.find(hash);
-    if (styles != _cache.end()) {
-        return styles->second;
+    {
+        std::lock_guard<std::mutex> lock(_cache_mutex);
+        auto styles = _cache.find(hash);
+        if (styles != _cache.end()) {
+            return styles->second;
+        }
     }
 
     std::multimap<double, style_t> ordering;
@@ -364,8 +367,8 @@ style_t const& theme_t::styles_for_scope(scope::scope_t const& scope)
         base.strikethrough,
         base.misspelled);
 
-    _cache.emplace(hash, _res);
-    return _cache.find(hash)->second;
+    std::lock_guard<std::mutex> lock(_cache_mutex);
+    return _cache.emplace(hash, _res).first->second;
 }
 
 style_t& style_t::operator+=(style_t const& rhs)
@@ -2,6 +2,7 @@
 #define THEME_THEME_H
 
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include "defines.h"
@@ -145,6 +146,7 @@ private:
     std::string _font_name;
     float _font_size;
 
+    std::mutex _cache_mutex;
     std::map<size_t, style_t> _cache;
     // mutable google::dense_hash_map<scope::scope_t, styles_t> _cache;
 